@@ -0,0 +1,113 @@
+// Copies a linked list over and over, once a cell at a time with cons and
+// free_list, and once with xmalloc_batch and xfree_batch, which take the
+// allocator's lock once for a whole chunk of cells, and prints how long
+// each way took.
+//
+// usage: batch-list-opt [length] [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "xmalloc.h"
+#include "list.h"
+
+#define CHUNK 64
+
+double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+cell*
+copy_list_batch(cell* xs)
+{
+    cell* head = 0;
+    cell** tail = &head;
+    void* cells[CHUNK];
+    while (xs) {
+        long nn = 0;
+        for (cell* ys = xs; ys && nn < CHUNK; ys = ys->rest) {
+            nn++;
+        }
+        if (xmalloc_batch(sizeof(cell), nn, cells) != nn) {
+            fprintf(stderr, "xmalloc_batch came up short\n");
+            exit(1);
+        }
+        for (long ii = 0; ii < nn; ii++) {
+            cell* ys = cells[ii];
+            ys->item = xs->item;
+            ys->rest = 0;
+            *tail = ys;
+            tail = &(ys->rest);
+            xs = xs->rest;
+        }
+    }
+    return head;
+}
+
+void
+free_list_batch(cell* xs)
+{
+    void* cells[CHUNK];
+    long nn = 0;
+    while (xs) {
+        cells[nn++] = xs;
+        xs = xs->rest;
+        if (nn == CHUNK) {
+            xfree_batch(cells, nn);
+            nn = 0;
+        }
+    }
+    xfree_batch(cells, nn);
+}
+
+int
+same_items(cell* xs, cell* ys)
+{
+    while (xs && ys) {
+        if (xs->item != ys->item) {
+            return 0;
+        }
+        xs = xs->rest;
+        ys = ys->rest;
+    }
+    return xs == ys;
+}
+
+int
+main(int argc, char* argv[])
+{
+    long length = argc > 1 ? atol(argv[1]) : 1000;
+    long rounds = argc > 2 ? atol(argv[2]) : 2000;
+
+    cell* xs = 0;
+    for (long ii = 0; ii < length; ++ii) {
+        xs = cons(ii, xs);
+    }
+
+    double t0 = now_sec();
+    for (long ii = 0; ii < rounds; ++ii) {
+        cell* ys = copy_list(xs);
+        free_list(ys);
+    }
+    double t1 = now_sec();
+    for (long ii = 0; ii < rounds; ++ii) {
+        cell* ys = copy_list_batch(xs);
+        if (ii == 0 && !same_items(xs, ys)) {
+            fprintf(stderr, "batch copy differs from the original\n");
+            return 1;
+        }
+        free_list_batch(ys);
+    }
+    double t2 = now_sec();
+
+    printf("%ld copies of %ld cells\n", rounds, count_list(xs));
+    printf("per cell: %.3f s\n", t1 - t0);
+    printf("batched:  %.3f s\n", t2 - t1);
+    free_list(xs);
+    return 0;
+}
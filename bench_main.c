@@ -0,0 +1,615 @@
+// Allocator throughput under a few standard multi-threaded workloads, for
+// thread counts doubling from 1 up to the given max, printed as CSV with
+// one line per workload and thread count: allocator calls per second and
+// the peak RSS of the run. Every run happens in a child process of its
+// own, so the peak RSS is that run's alone. The lines of several
+// allocators put together (make bench.csv) are ready to plot.
+//
+// usage: bench-opt [-l] [max threads] [workload ...]
+//
+// -l times every xmalloc, xfree and xrealloc call on its own instead, into
+// log-linear histograms (one per thread, merged at the end) and prints
+// p50, p99, p99.9 and max nanoseconds for every operation, for all calls
+// and for every power of two range of block sizes. The clock_gettime calls
+// around each one add some tens of nanoseconds to every sample.
+//
+// workloads:
+//   larson      random churn over a set of slots; between rounds every
+//               thread takes over the slots of the next one, so most
+//               frees are of blocks another thread allocated
+//   prodcons    every thread allocates into a queue that the next thread
+//               frees from
+//   threadtest  every thread allocates a batch of small blocks and frees
+//               them all, over and over
+//   realloc     buffers grown a little at a time with xrealloc
+//   mixed       churn over a live set with sizes from 16 bytes to 256K,
+//               mostly small
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "xmalloc.h"
+
+#define MAX_THREADS 256
+
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 20
+#define LARSON_OPS 10000
+
+#define QUEUE_SIZE 1024
+#define PRODCONS_ITEMS 500000
+
+#define THREADTEST_BATCH 1000
+#define THREADTEST_ROUNDS 1000
+
+#define REALLOC_BUFFERS 8
+#define REALLOC_ROUNDS 80
+#define REALLOC_LIMIT (64 * 1024)
+
+#define MIXED_SLOTS 2000
+#define MIXED_OPS 100000
+
+typedef struct queue {
+    void* items[QUEUE_SIZE];
+    // head only moves on the consuming thread, tail on the producing one
+    long head __attribute__((aligned(64)));
+    long tail __attribute__((aligned(64)));
+} queue;
+
+// a log-linear histogram of nanoseconds: every power of two is split in
+// HIST_SUB bins, so a bin is never more than 1/HIST_SUB of its values wide
+#define HIST_SUB 8
+#define HIST_BINS (64 * HIST_SUB)
+// block sizes are grouped by power of two, 2^SIZE_GROUPS and up together
+#define SIZE_GROUPS 20
+
+enum { OP_MALLOC, OP_FREE, OP_REALLOC, NUM_OPS };
+
+const char* op_names[NUM_OPS] = {"xmalloc", "xfree", "xrealloc"};
+
+typedef struct histogram {
+    long counts[HIST_BINS];
+    long max;
+} histogram;
+
+typedef struct worker {
+    pthread_t thread;
+    int index;
+    unsigned long rng;
+    long ops;
+    void** slots;
+    queue* queue;
+    // NUM_OPS * SIZE_GROUPS of them, when timing
+    histogram* hists;
+} worker;
+
+int nthreads;
+worker workers[MAX_THREADS];
+pthread_barrier_t barrier;
+int timing = 0;
+const char* allocator_name;
+
+double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift, every thread has its own state
+unsigned long
+next_rand(worker* ww)
+{
+    unsigned long xx = ww->rng;
+    xx ^= xx << 13;
+    xx ^= xx >> 7;
+    xx ^= xx << 17;
+    ww->rng = xx;
+    return xx;
+}
+
+long
+rand_between(worker* ww, long lo, long hi)
+{
+    return lo + next_rand(ww) % (hi - lo + 1);
+}
+
+long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int
+hist_bin(long ns)
+{
+    if (ns < HIST_SUB) {
+        return ns;
+    }
+    int top = 63 - __builtin_clzl(ns);
+    return (top - 2) * HIST_SUB + ((ns >> (top - 3)) & (HIST_SUB - 1));
+}
+
+// the biggest value that lands in the bin
+long
+hist_bin_top(int bin)
+{
+    if (bin < HIST_SUB) {
+        return bin;
+    }
+    int top = bin / HIST_SUB + 2;
+    return ((long) (HIST_SUB + bin % HIST_SUB + 1) << (top - 3)) - 1;
+}
+
+int
+size_group(long size)
+{
+    int group = size < 1 ? 0 : 63 - __builtin_clzl(size);
+    return group < SIZE_GROUPS ? group : SIZE_GROUPS - 1;
+}
+
+void
+record(worker* ww, int op, long size, long ns)
+{
+    histogram* hist = &(ww->hists[op * SIZE_GROUPS + size_group(size)]);
+    hist->counts[hist_bin(ns)]++;
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+}
+
+// the workloads make every allocator call through these three
+void*
+bench_malloc(worker* ww, long size)
+{
+    if (!timing) {
+        return xmalloc(size);
+    }
+    long t0 = now_ns();
+    void* ptr = xmalloc(size);
+    record(ww, OP_MALLOC, size, now_ns() - t0);
+    return ptr;
+}
+
+void
+bench_free(worker* ww, void* ptr)
+{
+    if (!timing) {
+        xfree(ptr);
+        return;
+    }
+    long size = xmalloc_usable_size(ptr);
+    long t0 = now_ns();
+    xfree(ptr);
+    record(ww, OP_FREE, size, now_ns() - t0);
+}
+
+void*
+bench_realloc(worker* ww, void* prev, long size)
+{
+    if (!timing) {
+        return xrealloc(prev, size);
+    }
+    long t0 = now_ns();
+    void* ptr = xrealloc(prev, size);
+    record(ww, OP_REALLOC, size, now_ns() - t0);
+    return ptr;
+}
+
+// writes a byte on every page of the block, so the pages count in RSS
+void
+touch(char* ptr, long size)
+{
+    for (long ii = 0; ii < size; ii += 4096) {
+        ptr[ii] = 1;
+    }
+    ptr[size - 1] = 1;
+}
+
+void*
+larson(void* arg)
+{
+    worker* ww = arg;
+    for (int round = 0; round < LARSON_ROUNDS; ++round) {
+        void** slots = ww->slots;
+        for (long ii = 0; ii < LARSON_OPS; ++ii) {
+            long jj = next_rand(ww) % LARSON_SLOTS;
+            if (slots[jj]) {
+                bench_free(ww, slots[jj]);
+                ww->ops++;
+            }
+            long size = rand_between(ww, 10, 500);
+            slots[jj] = bench_malloc(ww, size);
+            touch(slots[jj], size);
+            ww->ops++;
+        }
+        pthread_barrier_wait(&barrier);
+        // everyone hands their slots to the thread before them
+        if (ww->index == 0) {
+            void** first = workers[0].slots;
+            for (int ii = 0; ii < nthreads - 1; ++ii) {
+                workers[ii].slots = workers[ii + 1].slots;
+            }
+            workers[nthreads - 1].slots = first;
+        }
+        pthread_barrier_wait(&barrier);
+    }
+    for (long jj = 0; jj < LARSON_SLOTS; ++jj) {
+        if (ww->slots[jj]) {
+            bench_free(ww, ww->slots[jj]);
+            ww->ops++;
+        }
+    }
+    return 0;
+}
+
+void*
+prodcons(void* arg)
+{
+    worker* ww = arg;
+    queue* out = ww->queue;
+    queue* in = workers[(ww->index + 1) % nthreads].queue;
+    long made = 0;
+    long freed = 0;
+    while (made < PRODCONS_ITEMS || freed < PRODCONS_ITEMS) {
+        int moved = 0;
+        long tail = out->tail;
+        if (made < PRODCONS_ITEMS &&
+            tail - __atomic_load_n(&(out->head), __ATOMIC_ACQUIRE) < QUEUE_SIZE) {
+            long size = rand_between(ww, 16, 256);
+            char* ptr = bench_malloc(ww, size);
+            touch(ptr, size);
+            out->items[tail % QUEUE_SIZE] = ptr;
+            __atomic_store_n(&(out->tail), tail + 1, __ATOMIC_RELEASE);
+            made++;
+            moved = 1;
+        }
+        long head = in->head;
+        if (head < __atomic_load_n(&(in->tail), __ATOMIC_ACQUIRE)) {
+            bench_free(ww, in->items[head % QUEUE_SIZE]);
+            __atomic_store_n(&(in->head), head + 1, __ATOMIC_RELEASE);
+            freed++;
+            moved = 1;
+        }
+        if (!moved) {
+            sched_yield();
+        }
+    }
+    ww->ops = made + freed;
+    return 0;
+}
+
+void*
+threadtest(void* arg)
+{
+    worker* ww = arg;
+    void** batch = ww->slots;
+    for (int round = 0; round < THREADTEST_ROUNDS; ++round) {
+        for (long ii = 0; ii < THREADTEST_BATCH; ++ii) {
+            batch[ii] = bench_malloc(ww, 8);
+            *((char*) batch[ii]) = 1;
+        }
+        for (long ii = 0; ii < THREADTEST_BATCH; ++ii) {
+            bench_free(ww, batch[ii]);
+        }
+        ww->ops += 2 * THREADTEST_BATCH;
+    }
+    return 0;
+}
+
+void*
+realloc_growth(void* arg)
+{
+    worker* ww = arg;
+    char* bufs[REALLOC_BUFFERS];
+    long sizes[REALLOC_BUFFERS];
+    for (int round = 0; round < REALLOC_ROUNDS; ++round) {
+        for (int ii = 0; ii < REALLOC_BUFFERS; ++ii) {
+            bufs[ii] = 0;
+            sizes[ii] = 0;
+        }
+        // the buffers take turns, so they keep getting in each other's way
+        for (int done = 0; done < REALLOC_BUFFERS; ) {
+            done = 0;
+            for (int ii = 0; ii < REALLOC_BUFFERS; ++ii) {
+                if (sizes[ii] >= REALLOC_LIMIT) {
+                    done++;
+                    continue;
+                }
+                long size = sizes[ii] + rand_between(ww, 16, 128);
+                bufs[ii] = bench_realloc(ww, bufs[ii], size);
+                bufs[ii][size - 1] = 1;
+                sizes[ii] = size;
+                ww->ops++;
+            }
+        }
+        for (int ii = 0; ii < REALLOC_BUFFERS; ++ii) {
+            bench_free(ww, bufs[ii]);
+            ww->ops++;
+        }
+    }
+    return 0;
+}
+
+long
+mixed_size(worker* ww)
+{
+    long pick = next_rand(ww) % 1000;
+    if (pick < 800) {
+        return rand_between(ww, 16, 128);
+    }
+    if (pick < 950) {
+        return rand_between(ww, 129, 2048);
+    }
+    if (pick < 995) {
+        return rand_between(ww, 2049, 64 * 1024);
+    }
+    return rand_between(ww, 64 * 1024 + 1, 256 * 1024);
+}
+
+void*
+mixed(void* arg)
+{
+    worker* ww = arg;
+    void** slots = ww->slots;
+    for (long ii = 0; ii < MIXED_OPS; ++ii) {
+        long jj = next_rand(ww) % MIXED_SLOTS;
+        if (slots[jj]) {
+            bench_free(ww, slots[jj]);
+            ww->ops++;
+        }
+        long size = mixed_size(ww);
+        slots[jj] = bench_malloc(ww, size);
+        touch(slots[jj], size);
+        ww->ops++;
+    }
+    for (long jj = 0; jj < MIXED_SLOTS; ++jj) {
+        if (slots[jj]) {
+            bench_free(ww, slots[jj]);
+            ww->ops++;
+        }
+    }
+    return 0;
+}
+
+typedef struct workload {
+    const char* name;
+    void* (*run)(void*);
+    long slots;
+} workload;
+
+workload workloads[] = {
+    {"larson", larson, LARSON_SLOTS},
+    {"prodcons", prodcons, 0},
+    {"threadtest", threadtest, THREADTEST_BATCH},
+    {"realloc", realloc_growth, 0},
+    {"mixed", mixed, MIXED_SLOTS},
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// the smallest value at least fraction of the samples are at or under
+long
+percentile(histogram* hist, long count, double fraction)
+{
+    long want = (long) (fraction * count + 0.999999);
+    long seen = 0;
+    for (int bin = 0; bin < HIST_BINS; ++bin) {
+        seen += hist->counts[bin];
+        if (seen >= want) {
+            long top = hist_bin_top(bin);
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void
+print_latency(workload* wl, int nn, int op, const char* sizes, histogram* hist)
+{
+    long count = 0;
+    for (int bin = 0; bin < HIST_BINS; ++bin) {
+        count += hist->counts[bin];
+    }
+    if (count == 0) {
+        return;
+    }
+    printf("%s,%s,%d,%s,%s,%ld,%ld,%ld,%ld,%ld\n", allocator_name, wl->name,
+           nn, op_names[op], sizes, count, percentile(hist, count, 0.5),
+           percentile(hist, count, 0.99), percentile(hist, count, 0.999),
+           hist->max);
+}
+
+// merges the histograms of all threads and prints a line for every
+// operation, over all sizes and for every size group
+void
+print_latencies(workload* wl, int nn)
+{
+    static histogram merged[NUM_OPS * SIZE_GROUPS];
+    static histogram all[NUM_OPS];
+    memset(merged, 0, sizeof(merged));
+    memset(all, 0, sizeof(all));
+    for (int ii = 0; ii < nn; ++ii) {
+        for (int jj = 0; jj < NUM_OPS * SIZE_GROUPS; ++jj) {
+            histogram* from = &(workers[ii].hists[jj]);
+            histogram* to[] = {&(merged[jj]), &(all[jj / SIZE_GROUPS])};
+            for (int kk = 0; kk < 2; ++kk) {
+                for (int bin = 0; bin < HIST_BINS; ++bin) {
+                    to[kk]->counts[bin] += from->counts[bin];
+                }
+                if (from->max > to[kk]->max) {
+                    to[kk]->max = from->max;
+                }
+            }
+        }
+    }
+    for (int op = 0; op < NUM_OPS; ++op) {
+        print_latency(wl, nn, op, "all", &(all[op]));
+        for (int group = 0; group < SIZE_GROUPS; ++group) {
+            char sizes[32];
+            if (group == SIZE_GROUPS - 1) {
+                snprintf(sizes, sizeof(sizes), "%ld+", 1L << group);
+            } else {
+                snprintf(sizes, sizeof(sizes), "%ld-%ld", 1L << group,
+                         (2L << group) - 1);
+            }
+            print_latency(wl, nn, op, sizes, &(merged[op * SIZE_GROUPS + group]));
+        }
+    }
+    fflush(stdout);
+}
+
+// runs the workload on nn threads, in the calling process, and writes the
+// number of allocator calls and the seconds they took to fd
+void
+run_workload(workload* wl, int nn, int fd)
+{
+    nthreads = nn;
+    pthread_barrier_init(&barrier, 0, nn);
+    for (int ii = 0; ii < nn; ++ii) {
+        worker* ww = &(workers[ii]);
+        ww->index = ii;
+        ww->rng = 0x9e3779b97f4a7c15UL * (ii + 1);
+        ww->ops = 0;
+        // the bookkeeping comes from the allocator being measured too, but
+        // is set up before the clock starts
+        ww->slots = wl->slots ? xmalloc(wl->slots * sizeof(void*)) : 0;
+        if (ww->slots) {
+            memset(ww->slots, 0, wl->slots * sizeof(void*));
+        }
+        ww->queue = xmalloc(sizeof(queue));
+        memset(ww->queue, 0, sizeof(queue));
+        if (timing) {
+            ww->hists = xmalloc(NUM_OPS * SIZE_GROUPS * sizeof(histogram));
+            memset(ww->hists, 0, NUM_OPS * SIZE_GROUPS * sizeof(histogram));
+        }
+    }
+
+    double t0 = now_sec();
+    for (int ii = 0; ii < nn; ++ii) {
+        int rv = pthread_create(&(workers[ii].thread), 0, wl->run, &(workers[ii]));
+        if (rv != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    long ops = 0;
+    for (int ii = 0; ii < nn; ++ii) {
+        pthread_join(workers[ii].thread, 0);
+        ops += workers[ii].ops;
+    }
+    double t1 = now_sec();
+
+    if (timing) {
+        print_latencies(wl, nn);
+    }
+    dprintf(fd, "%ld %.6f\n", ops, t1 - t0);
+}
+
+// runs the workload in a child process and prints its line of CSV, or
+// when timing lets the child print its latencies
+int
+bench(const char* allocator, workload* wl, int nn)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        run_workload(wl, nn, fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+
+    char line[128];
+    long got = 0;
+    ssize_t rv;
+    while (got < sizeof(line) - 1 &&
+           (rv = read(fds[0], line + got, sizeof(line) - 1 - got)) > 0) {
+        got += rv;
+    }
+    line[got] = 0;
+    close(fds[0]);
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s on %d threads did not finish\n", wl->name, nn);
+        return 1;
+    }
+    long ops;
+    double secs;
+    if (sscanf(line, "%ld %lf", &ops, &secs) != 2) {
+        fprintf(stderr, "%s on %d threads reported nothing\n", wl->name, nn);
+        return 1;
+    }
+    if (!timing) {
+        printf("%s,%s,%d,%ld,%.3f,%.0f,%ld\n", allocator, wl->name, nn, ops,
+               secs, ops / secs, ru.ru_maxrss);
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int first = 1;
+    if (argc > 1 && strcmp(argv[1], "-l") == 0) {
+        timing = 1;
+        first = 2;
+    }
+    int max_threads = argc > first ? atoi(argv[first]) : 4;
+    if (max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [-l] [max threads] [workload ...]\n", argv[0]);
+        return 1;
+    }
+
+    static xmalloc_stats st;
+    xmalloc_get_stats(&st);
+    allocator_name = st.allocator;
+
+    int failed = 0;
+    if (timing) {
+        printf("allocator,workload,threads,op,sizes,count,p50_ns,p99_ns,p999_ns,max_ns\n");
+    } else {
+        printf("allocator,workload,threads,ops,seconds,ops_per_sec,peak_rss_kb\n");
+    }
+    for (int ii = 0; ii < NUM_WORKLOADS; ++ii) {
+        workload* wl = &(workloads[ii]);
+        int wanted = argc <= first + 1;
+        for (int jj = first + 1; jj < argc; ++jj) {
+            wanted |= strcmp(argv[jj], wl->name) == 0;
+        }
+        if (!wanted) {
+            continue;
+        }
+        for (int nn = 1; ; nn *= 2) {
+            if (nn > max_threads) {
+                nn = max_threads;
+            }
+            failed |= bench(st.allocator, wl, nn);
+            if (nn == max_threads) {
+                break;
+            }
+        }
+    }
+    return failed;
+}
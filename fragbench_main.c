@@ -0,0 +1,252 @@
+// How much memory the allocator holds on to beyond what the program asked
+// for, through a workload in phases:
+//
+//   grow      allocate many small blocks
+//   free      free two of every three, at random, the rest stay put
+//   regrow    allocate bigger blocks until as much is live as at the peak
+//   survive   free everything but a few of the first blocks
+//   trim      call xmalloc_trim
+//
+// Along the way it samples the bytes the program has live (asked for and
+// not freed yet) against the RSS and the mapped size of the process, both
+// from /proc/self/statm and both counted from where they were at the
+// start. It prints one line of CSV for the allocator:
+//
+//   frag_ratio          RSS over live bytes at the end of regrow
+//   peak_overhead_kb    the most RSS ever was above the live bytes
+//   returned_kb         how much RSS went back between the peak and the
+//                       end of survive
+//   trimmed_kb          how much more xmalloc_trim gave back
+//
+// With -t it prints every sample instead, as time series CSV.
+//
+// usage: fragbench-opt [-t] [blocks]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+
+// take a sample every this many calls
+#define SAMPLE_EVERY 2000
+// one in this many of the first blocks survives to the end
+#define SURVIVOR_EVERY 100
+
+typedef struct sample {
+    long live_kb;
+    long rss_kb;
+    long mapped_kb;
+} sample;
+
+int series = 0;
+const char* allocator_name;
+unsigned long rng = 0x9e3779b97f4a7c15UL;
+
+long live = 0;
+long calls = 0;
+sample base;
+sample peak;
+long peak_overhead = 0;
+const char* phase;
+long step = 0;
+
+unsigned long
+next_rand()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+long
+rand_between(long lo, long hi)
+{
+    return lo + next_rand() % (hi - lo + 1);
+}
+
+// reads the mapped size and RSS, with read(2) so it does not allocate
+void
+read_statm(sample* out)
+{
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    ssize_t got = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (got <= 0) {
+        fprintf(stderr, "can't read /proc/self/statm\n");
+        exit(1);
+    }
+    buf[got] = 0;
+    long size, resident;
+    sscanf(buf, "%ld %ld", &size, &resident);
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    out->mapped_kb = size * page_kb;
+    out->rss_kb = resident * page_kb;
+}
+
+sample
+take_sample()
+{
+    sample now;
+    read_statm(&now);
+    now.live_kb = live / 1024;
+    now.rss_kb -= base.rss_kb;
+    now.mapped_kb -= base.mapped_kb;
+    if (now.rss_kb - now.live_kb > peak_overhead) {
+        peak_overhead = now.rss_kb - now.live_kb;
+    }
+    if (now.live_kb > peak.live_kb) {
+        peak.live_kb = now.live_kb;
+    }
+    if (now.rss_kb > peak.rss_kb) {
+        peak.rss_kb = now.rss_kb;
+    }
+    if (now.mapped_kb > peak.mapped_kb) {
+        peak.mapped_kb = now.mapped_kb;
+    }
+    if (series) {
+        printf("%s,%s,%ld,%ld,%ld,%ld\n", allocator_name, phase, step++,
+               now.live_kb, now.rss_kb, now.mapped_kb);
+    }
+    return now;
+}
+
+void
+counted_call()
+{
+    if (++calls % SAMPLE_EVERY == 0) {
+        take_sample();
+    }
+}
+
+char*
+alloc_block(long size)
+{
+    char* ptr = xmalloc(size);
+    // every page of it is written, as a program filling it would
+    for (long ii = 0; ii < size; ii += 4096) {
+        ptr[ii] = 1;
+    }
+    ptr[size - 1] = 1;
+    live += size;
+    counted_call();
+    return ptr;
+}
+
+void
+drop_block(char* ptr, long size)
+{
+    xfree(ptr);
+    live -= size;
+    counted_call();
+}
+
+long
+small_size()
+{
+    long pick = next_rand() % 10;
+    return pick < 7 ? rand_between(16, 128) : rand_between(129, 512);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int first = 1;
+    if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+        series = 1;
+        first = 2;
+    }
+    long blocks = argc > first ? atol(argv[first]) : 100000;
+    if (blocks < 1) {
+        fprintf(stderr, "usage: %s [-t] [blocks]\n", argv[0]);
+        return 1;
+    }
+
+    static xmalloc_stats st;
+    xmalloc_get_stats(&st);
+    allocator_name = st.allocator;
+
+    // the bookkeeping comes from the allocator too, but before the baseline
+    char** ptrs = xmalloc(blocks * sizeof(char*));
+    long* sizes = xmalloc(blocks * sizeof(long));
+    char** more = xmalloc(blocks * sizeof(char*));
+    long* more_sizes = xmalloc(blocks * sizeof(long));
+    memset(ptrs, 0, blocks * sizeof(char*));
+    memset(more, 0, blocks * sizeof(char*));
+    memset(sizes, 0, blocks * sizeof(long));
+    memset(more_sizes, 0, blocks * sizeof(long));
+
+    if (series) {
+        printf("allocator,phase,step,live_kb,rss_kb,mapped_kb\n");
+    }
+    read_statm(&base);
+
+    phase = "grow";
+    for (long ii = 0; ii < blocks; ++ii) {
+        sizes[ii] = small_size();
+        ptrs[ii] = alloc_block(sizes[ii]);
+    }
+    long grown = live;
+    take_sample();
+
+    phase = "free";
+    for (long ii = 0; ii < blocks; ++ii) {
+        if (ii % SURVIVOR_EVERY != 0 && next_rand() % 3 != 0) {
+            drop_block(ptrs[ii], sizes[ii]);
+            ptrs[ii] = 0;
+        }
+    }
+    take_sample();
+
+    phase = "regrow";
+    long nmore = 0;
+    while (live < grown && nmore < blocks) {
+        more_sizes[nmore] = rand_between(513, 4096);
+        more[nmore] = alloc_block(more_sizes[nmore]);
+        nmore++;
+    }
+    sample regrown = take_sample();
+
+    phase = "survive";
+    for (long ii = 0; ii < blocks; ++ii) {
+        if (ptrs[ii] && ii % SURVIVOR_EVERY != 0) {
+            drop_block(ptrs[ii], sizes[ii]);
+            ptrs[ii] = 0;
+        }
+    }
+    for (long ii = 0; ii < nmore; ++ii) {
+        drop_block(more[ii], more_sizes[ii]);
+    }
+    sample survived = take_sample();
+
+    phase = "trim";
+    xmalloc_trim();
+    sample trimmed = take_sample();
+
+    if (!series) {
+        printf("allocator,peak_live_kb,peak_rss_kb,peak_mapped_kb,frag_ratio,"
+               "peak_overhead_kb,survivor_kb,end_rss_kb,returned_kb,trimmed_kb\n");
+        double ratio = regrown.live_kb ? (double) regrown.rss_kb / regrown.live_kb : 0;
+        printf("%s,%ld,%ld,%ld,%.2f,%ld,%ld,%ld,%ld,%ld\n", allocator_name,
+               peak.live_kb, peak.rss_kb, peak.mapped_kb, ratio, peak_overhead,
+               survived.live_kb, trimmed.rss_kb, peak.rss_kb - survived.rss_kb,
+               survived.rss_kb - trimmed.rss_kb);
+    }
+
+    for (long ii = 0; ii < blocks; ++ii) {
+        if (ptrs[ii]) {
+            xfree(ptrs[ii]);
+        }
+    }
+    xfree(ptrs);
+    xfree(sizes);
+    xfree(more);
+    xfree(more_sizes);
+    return 0;
+}
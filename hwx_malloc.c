@@ -8,159 +8,743 @@
 
 #include "xmalloc.h"
 
+// Blocks carry boundary tags: a header word in front of every block with
+// its size and flags, and a copy of the size in the last word of every
+// free block. So freeing a block finds both of its neighbours in constant
+// time and merges with whichever is free.
+//
+// Free blocks are filed by size. Those under SMALL_LIMIT go in one bin per
+// size, so the smallest non-empty bin at or above a request is its best
+// fit. Bigger ones go in one bin per power of two, each holding a bitwise
+// trie keyed on the size (like dlmalloc's tree bins), so the best fit is
+// found in one walk down a trie no deeper than the number of bits in the
+// size. Bitmaps of the non-empty bins skip straight to the next one that
+// can help.
+//
+// Small blocks are carved out of chunks, each of which ends in a used
+// block of size 0 so merging never runs off the end. Big blocks get an
+// mmap of their own.
+
 const size_t PAGE_SIZE = 4096;
-free_block* free_list = NULL;
+
+#define CHUNK_SIZE (256 * 1024)
+// the rest of the chunk once the first 8 bytes and the end tag are taken
+#define CHUNK_BLOCK (CHUNK_SIZE - 16)
+// blocks this big (header included) get a mapping of their own
+#define BIG_SIZE (CHUNK_SIZE / 4)
+// anything bigger is refused up front, so the rounding, the align padding
+// and the page round up of map_big can't wrap
+#define MAX_REQUEST (PTRDIFF_MAX - CHUNK_SIZE)
+
+#define USED 1 // the block is handed out
+#define PREV_USED 2 // the block right before it is handed out
+#define MAPPED 4 // a big block, alone in its mapping
+#define FLAGS 7
+
+// every block is a multiple of 16 long, big enough to hold the free list
+// links and the footer once it is freed
+#define MIN_BLOCK 32
+
+typedef struct tagged_block tagged_block;
+
+// a free block, a used one only has the tag before the data
+struct tagged_block {
+  size_t tag; // size of the whole block | flags
+  tagged_block* next;
+  tagged_block* prev;
+  // the rest is only there in blocks in the tree bins, which are at least
+  // SMALL_LIMIT long
+  tagged_block* child[2];
+  tagged_block* parent;
+  // the tree bin, -1 when some other block of the same size stands for
+  // this one in the trie and this one only hangs off its next/prev ring
+  long bin;
+};
+
+// blocks under this go in the small bins, one for every multiple of 16
+#define SMALL_LIMIT 512
+#define SMALL_BINS (SMALL_LIMIT / 16)
+// tree bin ii holds sizes from 2^(ii + 9) up to 2^(ii + 10)
+#define TREE_SHIFT 9
+#define TREE_BINS 10
+
+static tagged_block* small_bins[SMALL_BINS];
+static tagged_block* tree_bins[TREE_BINS];
+// bit ii is set when bin ii has something in it
+static uint32_t small_map = 0;
+static uint32_t tree_map = 0;
+// what was left of the last block split for a small request, free but in
+// no bin. Small requests without an exact fit keep carving from it, which
+// keeps runs of them next to each other and off the trie
+static tagged_block* victim = NULL;
+
+// freed blocks up to FAST_LIMIT long, tag included, skip all of the above.
+// They stay marked used on a LIFO list of their size, and the next request
+// of that size takes them straight back. They are only merged into the
+// heap when a request finds nothing else that fits, a request for a tree
+// sized block comes in, or a free makes a block of FAST_FLUSH or more
+#define FAST_LIMIT 128
+#define FAST_BINS (FAST_LIMIT / 16 + 1)
+#define FAST_FLUSH (64 * 1024)
+
+static tagged_block* fast_bins[FAST_BINS];
+static int have_fast = 0;
+// chunks with nothing in them, only one is kept
+static int empty_chunks = 0;
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// counters for xmalloc_get_stats, all of them only change under lock
+static xmalloc_stats counts;
 
+static size_t
+block_size(tagged_block* block)
+{
+  return block->tag & ~(size_t) FLAGS;
+}
 
-void
-coalesce()
+static tagged_block*
+next_block(tagged_block* block)
 {
-  free_block* prev = free_list;
-  if (prev == NULL) {
+  return ((void*) block) + block_size(block);
+}
+
+// the footer, last word of a free block
+static void
+set_footer(tagged_block* block)
+{
+  *((size_t*) (((void*) block) + block_size(block) - sizeof(size_t))) = block_size(block);
+}
+
+static int
+tree_bin(size_t size)
+{
+  return 63 - __builtin_clzl(size) - TREE_SHIFT;
+}
+
+// lines up the bit of size below the top bit of its bin with the top of
+// the word, the bits after that pick the way down the trie one by one
+static size_t
+tree_key(size_t size, int bin)
+{
+  return size << (64 - TREE_SHIFT - bin);
+}
+
+static void
+insert_small(tagged_block* block)
+{
+  int bin = block_size(block) / 16;
+  block->prev = NULL;
+  block->next = small_bins[bin];
+  if (small_bins[bin]) {
+    small_bins[bin]->prev = block;
+  }
+  small_bins[bin] = block;
+  small_map |= 1u << bin;
+}
+
+static void
+remove_small(tagged_block* block)
+{
+  int bin = block_size(block) / 16;
+  if (block->prev) {
+    block->prev->next = block->next;
+  } else {
+    small_bins[bin] = block->next;
+    if (block->next == NULL) {
+      small_map &= ~(1u << bin);
+    }
+  }
+  if (block->next) {
+    block->next->prev = block->prev;
+  }
+}
+
+static void
+insert_tree(tagged_block* block)
+{
+  size_t size = block_size(block);
+  int bin = tree_bin(size);
+  block->child[0] = NULL;
+  block->child[1] = NULL;
+  if (tree_bins[bin] == NULL) {
+    tree_bins[bin] = block;
+    tree_map |= 1u << bin;
+    block->parent = NULL;
+    block->bin = bin;
+    block->next = block;
+    block->prev = block;
     return;
   }
-  free_block* head = free_list->next;
-  if (head == 0) {
+  tagged_block* node = tree_bins[bin];
+  size_t key = tree_key(size, bin);
+  for (;;) {
+    if (block_size(node) == size) {
+      // one of this size is in the trie already, join its ring
+      block->parent = NULL;
+      block->bin = -1;
+      block->next = node->next;
+      block->prev = node;
+      node->next->prev = block;
+      node->next = block;
+      return;
+    }
+    tagged_block** slot = &(node->child[key >> 63]);
+    key <<= 1;
+    if (*slot == NULL) {
+      *slot = block;
+      block->parent = node;
+      block->bin = bin;
+      block->next = block;
+      block->prev = block;
+      return;
+    }
+    node = *slot;
+  }
+}
+
+// puts other where block was in the trie
+static void
+replace_node(tagged_block* block, tagged_block* other)
+{
+  tagged_block* parent = block->parent;
+  if (other) {
+    other->bin = block->bin;
+    other->parent = parent;
+    for (int ii = 0; ii < 2; ii++) {
+      other->child[ii] = block->child[ii];
+      if (other->child[ii]) {
+        other->child[ii]->parent = other;
+      }
+    }
+  }
+  if (parent == NULL) {
+    tree_bins[block->bin] = other;
+    if (other == NULL) {
+      tree_map &= ~(1u << block->bin);
+    }
+  } else {
+    parent->child[parent->child[1] == block] = other;
+  }
+}
+
+static void
+remove_tree(tagged_block* block)
+{
+  if (block->next != block) {
+    // another of the same size takes its place, if it had one
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    if (block->bin >= 0) {
+      replace_node(block, block->next);
+    }
     return;
   }
-  int count = 0;
-  for (; head != NULL; head=head->next) {
-    void* tmp = ((void*) prev) + prev->size;
-    // if these are adjacent
-    if ((uintptr_t) tmp == (uintptr_t) head) {
-      count++;
-      // add size to prev
-      prev->size += head->size;
-      // set next of prev to next of current (aka remove current from list)
-      prev->next = head->next;
+  // any leaf under it has the same bits so far, so one can take its place
+  tagged_block* leaf = block->child[1] ? block->child[1] : block->child[0];
+  if (leaf) {
+    while (leaf->child[0] || leaf->child[1]) {
+      leaf = leaf->child[1] ? leaf->child[1] : leaf->child[0];
     }
-    // set prev for next iteration
-    prev = head;
+    tagged_block* up = leaf->parent;
+    up->child[up->child[1] == leaf] = NULL;
+  }
+  replace_node(block, leaf);
+}
+
+// files a free block, with its tag already set, under its size
+static void
+insert_free(tagged_block* block)
+{
+  if (block_size(block) < SMALL_LIMIT) {
+    insert_small(block);
+  } else {
+    insert_tree(block);
   }
-  if (count > 0) {
-    coalesce();
+}
+
+static void
+remove_free(tagged_block* block)
+{
+  if (block == victim) {
+    victim = NULL;
+  } else if (block_size(block) < SMALL_LIMIT) {
+    remove_small(block);
+  } else {
+    remove_tree(block);
   }
 }
 
+// the smallest block in the trie under node at least size long
+static tagged_block*
+smallest_under(tagged_block* node, size_t size, tagged_block* best)
+{
+  while (node) {
+    if (block_size(node) >= size && (best == NULL || block_size(node) < block_size(best))) {
+      best = node;
+    }
+    node = node->child[0] ? node->child[0] : node->child[1];
+  }
+  return best;
+}
 
-void
-insert(free_block* to_insert)
+// the smallest free block at least size long, or NULL, leaving it filed
+static tagged_block*
+find_fit(size_t size)
 {
-  free_block* head = free_list;
-  if (head == 0) {
-    return;
+  if (size < SMALL_LIMIT) {
+    uint32_t bins = small_map & (~0u << (size / 16));
+    if (bins) {
+      return small_bins[__builtin_ctz(bins)];
+    }
+    if (tree_map == 0) {
+      return NULL;
+    }
+    return smallest_under(tree_bins[__builtin_ctz(tree_map)], 0, NULL);
   }
-  free_block* prev = NULL;
-  for (; head != NULL; head=head->next) {
-    // if these are adjacent
-    if ((uintptr_t) to_insert < (uintptr_t) head) {
-      if (prev != NULL) {
-        prev->next = to_insert;
+  int bin = tree_bin(size);
+  if (bin >= TREE_BINS) {
+    return NULL;
+  }
+  tagged_block* best = NULL;
+  // walk the path size would take, keeping the best on it and the deepest
+  // subtree to the right of it, everything there is bigger than size
+  tagged_block* node = tree_bins[bin];
+  tagged_block* bigger = NULL;
+  size_t key = tree_key(size, bin);
+  while (node) {
+    size_t have = block_size(node);
+    if (have >= size && (best == NULL || have < block_size(best))) {
+      best = node;
+      if (have == size) {
+        return best;
       }
-      to_insert->next = head;
-      break;
     }
-    // set prev for next iteration
-    prev = head;
+    tagged_block* right = node->child[1];
+    node = node->child[key >> 63];
+    key <<= 1;
+    if (right && right != node) {
+      bigger = right;
+    }
   }
-  // if we are inserting it to first slot fix free list pointer
-  if (prev == NULL) {
-    free_list = to_insert;
+  node = bigger;
+  if (node == NULL && best == NULL) {
+    uint32_t bins = tree_map & (~1u << bin);
+    if (bins == 0) {
+      return NULL;
+    }
+    node = tree_bins[__builtin_ctz(bins)];
   }
+  return smallest_under(node, size, best);
 }
 
-void
-add_or_discard(free_block* curr, free_block* prev)
+// turns a block into a free one, merging it with the free blocks on either
+// side of it, and returns how big the free block came out, must hold the
+// lock
+static size_t
+release_block(tagged_block* block)
 {
-  if (curr->size > sizeof(free_block)) {
-    if (prev == NULL) {
-      // if we are messing with head of list
-      free_list = curr;
-    } else {
-      prev->next = curr;
+  size_t size = block_size(block);
+  size_t prev_used = block->tag & PREV_USED;
+  tagged_block* next = next_block(block);
+  if (next->tag & USED) {
+    next->tag &= ~(size_t) PREV_USED;
+  } else {
+    remove_free(next);
+    size += block_size(next);
+  }
+  if (!prev_used) {
+    size_t prev_size = *((size_t*) (((void*) block) - sizeof(size_t)));
+    block = ((void*) block) - prev_size;
+    remove_free(block);
+    size += prev_size;
+    // two free blocks are never next to each other, so this one's
+    // neighbour is used
+    prev_used = PREV_USED;
+  }
+  if (size == CHUNK_BLOCK) {
+    // the whole chunk is free, keep the first such one for the next
+    // malloc and give the others back
+    if (empty_chunks > 0) {
+      munmap(((void*) block) - sizeof(size_t), CHUNK_SIZE);
+      counts.munmaps++;
+      return size;
+    }
+    empty_chunks++;
+  }
+  block->tag = size | prev_used;
+  set_footer(block);
+  insert_free(block);
+  return size;
+}
+
+// merges everything on the fast bins back into the heap, must hold the lock
+static void
+consolidate()
+{
+  for (int ii = 0; ii < FAST_BINS; ii++) {
+    tagged_block* block = fast_bins[ii];
+    fast_bins[ii] = NULL;
+    while (block) {
+      tagged_block* next = block->next;
+      release_block(block);
+      block = next;
+    }
+  }
+  have_fast = 0;
+}
+
+// the free block to carve size bytes from, still filed, or NULL
+static tagged_block*
+pick_block(size_t size)
+{
+  if (size < SMALL_LIMIT && !(small_map & (1u << (size / 16))) && victim && block_size(victim) >= size) {
+    return victim;
+  }
+  return find_fit(size);
+}
+
+// maps another chunk, which starts out as one free block, not yet filed
+static tagged_block*
+new_chunk()
+{
+  void* chunk = mmap(NULL, CHUNK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED) {
+    return NULL;
+  }
+  counts.mmaps++;
+  // the first 8 bytes are skipped so the data of every block is 16 aligned
+  tagged_block* block = chunk + sizeof(size_t);
+  block->tag = CHUNK_BLOCK | PREV_USED;
+  set_footer(block);
+  tagged_block* end = next_block(block);
+  end->tag = 0 | USED;
+  return block;
+}
+
+// hands out size bytes, tag included, from the smallest free block big
+// enough, splitting off what is left over when that can stand on its own,
+// must hold the lock
+static tagged_block*
+take_block(size_t size)
+{
+  if (size <= FAST_LIMIT && fast_bins[size / 16]) {
+    tagged_block* block = fast_bins[size / 16];
+    fast_bins[size / 16] = block->next;
+    counts.live_bytes += size;
+    return block;
+  }
+  int small = size < SMALL_LIMIT;
+  if (have_fast && !small) {
+    consolidate();
+  }
+  tagged_block* block = pick_block(size);
+  if (block == NULL && have_fast) {
+    consolidate();
+    block = pick_block(size);
+  }
+  if (block == NULL) {
+    block = new_chunk();
+    if (block == NULL) {
+      return NULL;
     }
   } else {
-    if (prev == NULL) {
-      free_list = NULL;
+    remove_free(block);
+    if (block_size(block) == CHUNK_BLOCK) {
+      empty_chunks--;
+    }
+  }
+  size_t have = block_size(block);
+  size_t prev_used = block->tag & PREV_USED;
+  if (have - size >= MIN_BLOCK) {
+    block->tag = size | USED | prev_used;
+    tagged_block* rest = next_block(block);
+    rest->tag = (have - size) | PREV_USED;
+    set_footer(rest);
+    if (small) {
+      if (victim) {
+        insert_free(victim);
+      }
+      victim = rest;
     } else {
-      prev->next = curr->next;
+      insert_free(rest);
     }
+  } else {
+    block->tag = have | USED | prev_used;
+    next_block(block)->tag |= PREV_USED;
   }
+  counts.live_bytes += block_size(block);
+  return block;
+}
+
+// the whole block for a request of bytes, tag included
+static size_t
+block_for(size_t bytes)
+{
+  size_t size = (bytes + sizeof(size_t) + 15) & ~(size_t) 15;
+  return size < MIN_BLOCK ? MIN_BLOCK : size;
+}
+
+// maps a big block with its data starting on a multiple of align. The tag
+// goes right in front of the data and keeps the length from itself to the
+// end of the mapping, xfree unmaps from the page the tag is on
+static void*
+map_big(size_t bytes, size_t align)
+{
+  size_t length = (bytes + align + sizeof(size_t) + PAGE_SIZE - 1) & -PAGE_SIZE;
+  void* map = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  void* data = (void*) (((uintptr_t) map + sizeof(size_t) + align - 1) & -align);
+  tagged_block* block = data - sizeof(size_t);
+  void* start = (void*) ((uintptr_t) block & -PAGE_SIZE);
+  if (start != map) {
+    munmap(map, start - map);
+  }
+  block->tag = (map + length - (void*) block) | USED | MAPPED;
+  int ret = pthread_mutex_lock(&lock);
+  assert(ret != -1);
+  counts.lock_acquisitions++;
+  counts.allocs++;
+  counts.large_allocs++;
+  counts.mmaps++;
+  counts.live_bytes += block_size(block);
+  ret = pthread_mutex_unlock(&lock);
+  assert(ret != -1);
+  return data;
 }
 
 void*
-xmalloc(size_t size)
+xmalloc(size_t bytes)
 {
+  if (bytes > MAX_REQUEST) {
+    return NULL;
+  }
+  size_t size = block_for(bytes);
+  if (size >= BIG_SIZE) {
+    return map_big(bytes, 16);
+  }
   int ret = pthread_mutex_lock(&lock);
   assert(ret != -1);
-  size += sizeof(size_t);
-  if (size < PAGE_SIZE) {
-    free_block* prev = NULL;
-    free_block* curr = free_list;
-    for (; curr != NULL; curr=curr->next) {
-      if (curr->size >= size) {
-        size_t oldSize = curr->size;
-        block_header* block = (void*) curr;
-        block->size = size;
-        curr = ((void*) curr) + size;
-        curr->size = oldSize - size;
-        add_or_discard(curr, prev);
-        ret = pthread_mutex_unlock(&lock);
-        assert(ret != -1);
-        return ((void*) block) + sizeof(size_t); 
+  counts.lock_acquisitions++;
+  counts.allocs++;
+  tagged_block* block = take_block(size);
+  ret = pthread_mutex_unlock(&lock);
+  assert(ret != -1);
+  if (block == NULL) {
+    return NULL;
+  }
+  return ((void*) block) + sizeof(size_t);
+}
 
-      }
-      prev = curr;
-    }
-    // no more space, map extra page 
-    block_header* new_header = mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-    new_header->size = size;
-    free_block* new_block = ((void*) new_header) + size;
-    new_block->size = PAGE_SIZE - size;
-    if (new_block->size > sizeof(free_block)) {
-      insert(new_block);
-    }
-    ret = pthread_mutex_unlock(&lock);
-    assert(ret != -1);
-    return ((void*) new_header) + sizeof(size_t);
-  } else {
-    void* block = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-    ((block_header*) block)->size = size - sizeof(size_t);
-    ret = pthread_mutex_unlock(&lock);
-    assert(ret != -1);
-    return block + sizeof(size_t);
+void*
+xcalloc(size_t count, size_t size)
+{
+  size_t bytes;
+  if (__builtin_mul_overflow(count, size, &bytes)) {
+    return NULL;
+  }
+  void* item = xmalloc(bytes);
+  // a big block is a mapping of its own, fresh from the OS and zero already
+  if (item != NULL && block_for(bytes) < BIG_SIZE) {
+    memset(item, 0, bytes);
   }
+  return item;
 }
 
 void
 xfree(void* item)
 {
+  if (item == NULL) {
+    return;
+  }
+  tagged_block* block = item - sizeof(size_t);
+  if (block->tag & MAPPED) {
+    size_t size = block_size(block);
+    void* start = (void*) ((uintptr_t) block & -PAGE_SIZE);
+    munmap(start, ((void*) block - start) + size);
+    int ret = pthread_mutex_lock(&lock);
+    assert(ret != -1);
+    counts.lock_acquisitions++;
+    counts.frees++;
+    counts.munmaps++;
+    counts.live_bytes -= size;
+    ret = pthread_mutex_unlock(&lock);
+    assert(ret != -1);
+    return;
+  }
   int ret = pthread_mutex_lock(&lock);
   assert(ret != -1);
-    // TODO: replace this with free
-    void* item_f = item - sizeof(size_t);
-    size_t size = *((size_t*) item_f);
-    // to account for size we keep track of
-    if (size < PAGE_SIZE) {
-      free_block* new = item_f;
-      new->size = size;
-      insert(new);
-      coalesce();
-    } else {
-      size += sizeof(size_t);
-      munmap(item_f, size);
-    }
+  counts.lock_acquisitions++;
+  counts.frees++;
+  size_t size = block_size(block);
+  counts.live_bytes -= size;
+  if (size <= FAST_LIMIT) {
+    block->next = fast_bins[size / 16];
+    fast_bins[size / 16] = block;
+    have_fast = 1;
+  } else if (release_block(block) >= FAST_FLUSH && have_fast) {
+    consolidate();
+  }
+  ret = pthread_mutex_unlock(&lock);
+  assert(ret != -1);
+}
+
+void*
+xmalloc_aligned(size_t size, size_t align)
+{
+  // the data of every block is already 16 byte aligned
+  if (align <= 16) {
+    return xmalloc(size);
+  }
+  if (size > MAX_REQUEST || align > MAX_REQUEST - size) {
+    return NULL;
+  }
+  if (block_for(size + align + MIN_BLOCK) >= BIG_SIZE) {
+    return map_big(size, align);
+  }
+  // take enough to slide the data up to the boundary, leaving either
+  // nothing or a whole free block in front of it
+  void* item = xmalloc(size + align + MIN_BLOCK);
+  if (item == NULL) {
+    return NULL;
+  }
+  void* aligned = (void*) (((uintptr_t) item + align - 1) & -align);
+  if (aligned != item && aligned - item < MIN_BLOCK) {
+    aligned += align;
+  }
+  if (aligned != item) {
+    int ret = pthread_mutex_lock(&lock);
+    assert(ret != -1);
+    tagged_block* front = item - sizeof(size_t);
+    tagged_block* block = aligned - sizeof(size_t);
+    size_t total = block_size(front);
+    size_t front_size = aligned - item;
+    front->tag = front_size | USED | (front->tag & PREV_USED);
+    block->tag = (total - front_size) | USED | PREV_USED;
+    counts.live_bytes -= front_size;
+    release_block(front);
     ret = pthread_mutex_unlock(&lock);
     assert(ret != -1);
+  }
+  return aligned;
 }
 
-
 void*
 xrealloc(void* prev, size_t nn)
 {
-	void* new_space = xmalloc(nn);
-	memcpy(new_space, prev, nn);
-	xfree(prev);
-	return new_space;	
+  if (prev == NULL) {
+    return xmalloc(nn);
+  }
+  if (nn > MAX_REQUEST) {
+    return NULL;
+  }
+  tagged_block* block = prev - sizeof(size_t);
+  size_t size = block_for(nn);
+  if (!(block->tag & MAPPED) && size < BIG_SIZE) {
+    int ret = pthread_mutex_lock(&lock);
+    assert(ret != -1);
+    counts.lock_acquisitions++;
+    size_t have = block_size(block);
+    tagged_block* next = next_block(block);
+    // a free block right behind it can make up the difference
+    if (have < size && !(next->tag & USED) && have + block_size(next) >= size) {
+      remove_free(next);
+      have += block_size(next);
+      counts.live_bytes += block_size(next);
+      block->tag = have | (block->tag & FLAGS);
+      next = next_block(block);
+      next->tag |= PREV_USED;
+    }
+    if (have >= size) {
+      // give back the tail when it is worth a block of its own
+      if (have - size >= MIN_BLOCK) {
+        block->tag = size | (block->tag & FLAGS);
+        tagged_block* rest = next_block(block);
+        rest->tag = (have - size) | USED | PREV_USED;
+        counts.live_bytes -= have - size;
+        release_block(rest);
+      }
+      ret = pthread_mutex_unlock(&lock);
+      assert(ret != -1);
+      return prev;
+    }
+    ret = pthread_mutex_unlock(&lock);
+    assert(ret != -1);
+  }
+  void* new_space = xmalloc(nn);
+  if (new_space == NULL) {
+    return NULL;
+  }
+  size_t old = xmalloc_usable_size(prev);
+  memcpy(new_space, prev, old < nn ? old : nn);
+  xfree(prev);
+  return new_space;
+}
+
+size_t
+xmalloc_batch(size_t bytes, size_t count, void** out)
+{
+  for (size_t ii = 0; ii < count; ii++) {
+    out[ii] = xmalloc(bytes);
+    if (out[ii] == NULL) {
+      return ii;
+    }
+  }
+  return count;
+}
+
+void
+xfree_batch(void** ptrs, size_t count)
+{
+  for (size_t ii = 0; ii < count; ii++) {
+    if (ptrs[ii]) {
+      xfree(ptrs[ii]);
+    }
+  }
+}
+
+void
+xfree_sized(void* item, size_t size)
+{
+  // the block keeps its own size anyway
+  xfree(item);
+}
+
+size_t
+xmalloc_usable_size(void* item)
+{
+  tagged_block* block = item - sizeof(size_t);
+  return block_size(block) - sizeof(size_t);
+}
+
+size_t
+xmalloc_trim()
+{
+  // a free block as big as a chunk is the one empty chunk kept around
+  size_t released = 0;
+  int ret = pthread_mutex_lock(&lock);
+  assert(ret != -1);
+  counts.lock_acquisitions++;
+  consolidate();
+  tagged_block* block;
+  while ((block = find_fit(CHUNK_BLOCK)) != NULL) {
+    remove_free(block);
+    munmap(((void*) block) - sizeof(size_t), CHUNK_SIZE);
+    counts.munmaps++;
+    released += CHUNK_SIZE;
+  }
+  empty_chunks = 0;
+  ret = pthread_mutex_unlock(&lock);
+  assert(ret != -1);
+  return released;
+}
+
+void
+xmalloc_get_stats(xmalloc_stats* stats)
+{
+  // one heap and one lock, so no classes or arenas to report
+  pthread_mutex_lock(&lock);
+  *stats = counts;
+  pthread_mutex_unlock(&lock);
+  stats->allocator = "hwx";
 }
@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
 #include "xmalloc.h"
+#include "size_classes.h"
+#include "xstats.h"
 #include <sys/mman.h>
 #include <string.h>
 #include <math.h>
@@ -6,42 +9,290 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <execinfo.h>
 
 typedef struct page_header page_header;
+typedef struct remote_block remote_block;
+
+// a remotely freed block, its first 8 bytes link it into remote_free
+struct remote_block {
+	remote_block* next;
+};
 
 struct page_header {
 	size_t size; // 8 bytes
 	page_header* next; // 8 bytes
 	page_header* prev; // 8 bytes
-	int bitmap[16]; // 64 bytes
-	int tidx; // 4 bytes
+	uint64_t bitmap[8]; // 64 bytes
+	int tidx; // 4 bytes, index of the arena that owns this page
+	int bucket; // 4 bytes, size class of the slab
+	int blocks; // 4 bytes, how many blocks fit in the slab
+	int free_count; // 4 bytes, how many of them are free
+	// 8 bytes, blocks freed by threads of other arenas, waiting for the
+	// owning arena to put them back in the bitmap, or PAGE_FULL
+	remote_block* remote_free;
+	// 4 bytes, the first block never handed out. If the slab was all zero
+	// when it was set up, it and every block after it still are
+	int untouched;
+	// 12 bytes, makes the header two whole cache lines, so the blocks
+	// right behind it start on one
+	char pad[12];
 };
+_Static_assert(sizeof(page_header) == 128, "blocks would not start on a cache line");
 
-typedef struct special_page_header {
-	size_t size; // 8 bytes
-	size_t proof; // used as proof that its a special header
-} special_page_header;
-
-// if smallest size is 8, then most bytes we need is 64, which is 16 ints
-const int BITMAP_LENGTH = 16;
-const int BITS_PER_INT = 8 * sizeof(int);
-const int BIGGEST_SIZE = 3192;
-// sizes for easy lookup
-const size_t sizes[18] = { 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3192 };
-// array of pointers to page headers
-static page_header* bins[18][4];
-// initialize all threads to pthread initializer
-static pthread_mutex_t locks[4] = { PTHREAD_MUTEX_INITIALIZER };
+
+// sits right in front of every block too big for the size classes, which
+// is either a medium span carved out of a segment of its arena or a huge
+// block with an mmap of its own. An aligned block sits further in, with a
+// copy of the header right in front of it
+typedef struct special_page_header special_page_header;
+
+struct special_page_header {
+	size_t size; // 8 bytes, bytes of the span or mapping, header included
+	int tidx; // 4 bytes, arena of a medium span, -1 for a huge block
+	int pages; // 4 bytes, length of a medium span in pages
+	special_page_header* start; // 8 bytes, where the span or mapping begins
+	int zeroed; // 4 bytes, it was all zero when it was handed out
+	int unused; // 4 bytes, keeps the blocks 16 byte aligned
+};
+// biggest span, header included, served from the segments of an arena
+#define MEDIUM_MAX (1024 * 1024)
+// biggest request xmalloc takes, so adding a header, an alignment and the
+// rounding to pages can never wrap around. Nothing bigger fits in the
+// address space anyway
+#define MAX_REQUEST (PTRDIFF_MAX - 2 * (size_t) SEGMENT_SIZE)
+
+// no slab holds more than 512 blocks, so 64 bytes of bitmap is 8 words
+const int BITMAP_LENGTH = 8;
+const int BITS_PER_WORD = 64;
+// remote_free of a page that is out of its bin because it is full
+#define PAGE_FULL ((remote_block*) 1)
 const size_t PAGE_SIZE = 4096;
+
+#define CLASS_SIZE(size, pages, a) size,
+#define CLASS_PAGES(size, pages, a) pages,
+// block size and slab length in pages of every class, from size_classes.h
+static const size_t sizes[NUM_CLASSES] = { SIZE_CLASSES(CLASS_SIZE, 0) };
+static const int slab_pages[NUM_CLASSES] = { SIZE_CLASSES(CLASS_PAGES, 0) };
+// smallest class for every request size, worked out by the compiler
+static const unsigned char class_lookup[LOOKUP_SLOTS] = { REPEAT_256(LOOKUP_ENTRY, 0) };
+_Static_assert(LOOKUP_SLOTS == 256, "class_lookup is filled by REPEAT_256");
+
+#define CLASS_FITS_BITMAP(size, pages, a) \
+	_Static_assert(((pages) * 4096 - sizeof(page_header)) / (size) <= 8 * 64, \
+		"slab has more blocks than the bitmap has bits");
+SIZE_CLASSES(CLASS_FITS_BITMAP, 0)
+const int MAX_ARENAS = 256;
+
+// an empty slab kept around by its arena so the next slab of that length
+// does not cost an mmap
+typedef struct cached_slab {
+	void* addr;
+	int pages;
+	int decayed; // its memory was already given back with madvise
+	long idle_since; // ms timestamp of when it became empty
+} cached_slab;
+
+// The page map has one byte for every page of the address space, saying
+// what xmalloc put there, so any pointer is classified without touching the
+// memory around it. It is a two level radix tree, the top level indexed by
+// address bits 47..32 and each leaf by bits 31..12, leaves are mapped the
+// first time a page in their 4 GiB is used, and only the parts of them that
+// get written cost memory
+#define PAGE_MAP_TOP (1 << 16)
+#define PAGE_MAP_LEAF (1 << 20)
+// page kinds besides 1 + the size class of a slab page
+#define PAGE_UNKNOWN 0
+#define PAGE_GUARDED 253
+#define PAGE_MEDIUM 254
+#define PAGE_HUGE 255
+_Static_assert(NUM_CLASSES < PAGE_GUARDED, "page kinds overlap the classes");
+
+// how many empty slabs an arena can hold on to at most
+#define SLAB_CACHE_SLOTS 64
+
+// a freed huge block kept mapped so the next one of about its size does
+// not cost an mmap and a munmap
+typedef struct cached_mapping {
+	void* addr;
+	size_t length;
+	long idle_since; // ms timestamp of when it was freed
+} cached_mapping;
+
+#define HUGE_CACHE_SLOTS 8
+
+// Slabs are carved out of SEGMENT_SIZE reservations aligned to their size,
+// so a segment is one mmap and one VMA for many slabs. Page 0 holds the
+// segment header, which records for every page where its slab starts, so
+// rounding a block address down to the segment and one lookup finds the
+// page header. 2 MiB is also the size of an x86 huge page.
+#define SEGMENT_SIZE (2 * 1024 * 1024)
+#define SEGMENT_PAGES (SEGMENT_SIZE / 4096)
+
+typedef struct segment segment;
+
+struct segment {
+	segment* next; // links the segments of the arena with a free page
+	segment* prev;
+	int tidx; // arena the segment belongs to
+	int used_pages; // pages holding a slab, cached ones and page 0 included
+	uint64_t used[SEGMENT_PAGES / 64]; // bit per page holding a slab
+	uint16_t slab_start[SEGMENT_PAGES]; // first page of the slab of each page
+};
+_Static_assert(sizeof(segment) <= 4096, "segment header must fit in page 0");
+
+#define CLASS_FITS_SEGMENT(size, pages, a) \
+	_Static_assert((pages) < SEGMENT_PAGES, "slab bigger than a segment");
+SIZE_CLASSES(CLASS_FITS_SEGMENT, 0)
+
+// what an arena counts for xmalloc_get_stats. The per class counters only
+// change under the arena lock, the rest is bumped with relaxed atomics by
+// whichever thread does the work, often without holding any lock
+typedef struct arena_stats {
+	size_t allocs[NUM_CLASSES];
+	size_t frees[NUM_CLASSES];
+	size_t pages[NUM_CLASSES]; // pages held by slabs of the class
+	size_t lock_acquisitions;
+	size_t mmaps;
+	size_t munmaps;
+	size_t large_allocs;
+	size_t large_frees;
+	size_t large_bytes; // bytes mapped for live medium and huge blocks
+} arena_stats;
+
+// every arena has its own lock and its own bins of page headers, padded out
+// to a whole number of cache lines so neighbouring arenas never share one.
+// A bin only holds pages with at least one free block, full pages are
+// linked back in when a block on them is freed
+typedef struct arena {
+	pthread_mutex_t lock;
+	page_header* bins[NUM_CLASSES];
+	// blocks other arenas freed while their page was full
+	remote_block* delayed_free;
+	// empty slabs waiting to be reused, in no particular order
+	cached_slab slab_cache[SLAB_CACHE_SLOTS];
+	int cached_slabs;
+	long next_decay; // ms timestamp of the next pass over slab_cache
+	// segments with at least one free page
+	segment* segments;
+	arena_stats stats;
+} __attribute__((aligned(64))) arena;
+
+static arena* arenas = 0;
+static int num_arenas = 0;
+static int next_arena = 0;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+// arena this thread is bound to, -1 until its first xmalloc
+static __thread int thread_arena = -1;
+// empty slabs each arena keeps, OPT_MALLOC_RETAIN overrides it
+static int retain_slabs = 16;
+// ms a cached slab stays idle before its memory is madvised away,
+// OPT_MALLOC_DECAY_MS overrides it
+static long decay_ms = 1000;
+// OPT_MALLOC_THP=1 asks for transparent huge pages to back the segments
+static int use_thp = 0;
+static uint8_t* page_map[PAGE_MAP_TOP];
+// freed huge blocks, shared by all arenas, at most huge_cache_limit bytes
+// of them (OPT_MALLOC_HUGE_CACHE) and none kept longer than decay_ms
+static cached_mapping huge_cache[HUGE_CACHE_SLOTS];
+static int cached_mappings = 0;
+static size_t huge_cache_bytes = 0;
+static size_t huge_cache_limit = 64 * 1024 * 1024;
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a slot of the guard pool, see guarded_alloc
+typedef struct guard_slot {
+	void* ptr; // the block, 0 while the slot was never used
+	size_t size; // bytes asked for
+	int live;
+	long freed_at; // guard_frees when it went into quarantine
+	void* alloc_site; // return addresses of the xmalloc and xfree calls
+	void* free_site;
+} guard_slot;
+
+// OPT_MALLOC_GUARD_SAMPLE=N sends about one in N small xmallocs to the
+// guard pool, which has OPT_MALLOC_GUARD_SLOTS slots
+static long guard_sample = 0;
+static int guard_slots = 64;
+static pthread_once_t guard_once = PTHREAD_ONCE_INIT;
+// a guard page, then a slot page and a guard page for every slot
+static char* guard_pool = 0;
+static size_t guard_length = 0;
+static guard_slot* guard_table = 0;
+static long guard_frees = 0;
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction old_segv;
+// xmallocs left on this thread until the next sampled one
+static __thread long guard_countdown = 0;
+static __thread uint64_t guard_rng = 0;
+
+// a call stack the heap profiler has seen, and what it allocated
+#define PROFILE_DEPTH 32
+typedef struct profile_stack {
+	uint64_t hash; // 0 while the entry is empty
+	int depth;
+	void* frames[PROFILE_DEPTH];
+	size_t allocs; // sampled blocks, all of them and the live ones
+	size_t alloc_bytes;
+	size_t live;
+	size_t live_bytes;
+} profile_stack;
+
+// a live sampled block
+typedef struct profile_object {
+	void* ptr; // 0 while the entry is empty
+	size_t size;
+	profile_stack* stack;
+} profile_object;
+
+// both are open addressing hash tables, the objects one sized for way more
+// live samples than any heap this runs under should have
+#define PROFILE_STACKS (1 << 14)
+#define PROFILE_OBJECTS (1 << 18)
+#define PROFILE_FILTER (1 << 16)
+
+// OPT_MALLOC_PROFILE=prefix samples about one block every profile_rate
+// bytes (OPT_MALLOC_PROFILE_RATE) and writes prefix.pid.seq.heap at exit
+// and at the next sample or sampled xfree after OPT_MALLOC_PROFILE_SIGNAL,
+// folded stacks with OPT_MALLOC_PROFILE_FORMAT=folded
+static const char* profile_prefix = 0;
+static long profile_rate = 512 * 1024;
+static int profile_signal = 0;
+static int profile_folded = 0;
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+static profile_stack* profile_stacks = 0;
+static profile_object* profile_objects = 0;
+// how many live samples hash to every slot, so xfree can tell a block was
+// not sampled without the lock. Also the flag that the profiler is on
+static uint16_t* profile_filter = 0;
+static size_t profile_dropped = 0;
+static int profile_dumps = 0;
+// set by the signal, the next profile_unlock writes the profile
+static volatile sig_atomic_t profile_pending = 0;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+// bytes left for this thread to xmalloc until the next sample
+static __thread long profile_countdown = 0;
+static __thread uint64_t profile_rng = 0;
 //static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+_Static_assert(NUM_CLASSES <= XMALLOC_MAX_CLASSES, "too many classes for xmalloc_stats");
 
-// 18 buckets = { 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 
-// 384, 512, 768, 1024, 1536, 2048, 3192 }
+arena_stats* thread_stats();
+void count_event(size_t* counter, size_t amount);
+
+
+// buckets and their slab lengths are listed in size_classes.h
 
 // 0 is free, 1 is full/unusable
-// so if int = 0, whole page is free
-// if int = -1, whole page is full
+// so if a word = 0, all its blocks are free
+// if a word = -1, all its blocks are used
 
 // taken from Nat Tuck's notes from this semester
 void
@@ -53,248 +304,2062 @@ assert_ok(long rv, const char* call)
     }
 }
 
+// gets what the page holding ptr is, see PAGE_MEDIUM and friends
+int
+page_kind(void* ptr)
+{
+	uintptr_t page = (uintptr_t) ptr / 4096;
+	if (page / PAGE_MAP_LEAF >= PAGE_MAP_TOP) {
+		return PAGE_UNKNOWN;
+	}
+	uint8_t* leaf = __atomic_load_n(&(page_map[page / PAGE_MAP_LEAF]), __ATOMIC_ACQUIRE);
+	if (leaf == 0) {
+		return PAGE_UNKNOWN;
+	}
+	return leaf[page % PAGE_MAP_LEAF];
+}
+
+// records what the given pages are now
+void
+set_page_kind(void* addr, size_t pages, int kind)
+{
+	uintptr_t first = (uintptr_t) addr / 4096;
+	for (uintptr_t page = first; page < first + pages; page++) {
+		uintptr_t top = page / PAGE_MAP_LEAF;
+		if (top >= PAGE_MAP_TOP) {
+			fprintf(stderr, "xmalloc: %p is past the page map\n", addr);
+			abort();
+		}
+		uint8_t* leaf = __atomic_load_n(&(page_map[top]), __ATOMIC_ACQUIRE);
+		if (leaf == 0) {
+			uint8_t* fresh = mmap(NULL, PAGE_MAP_LEAF, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			assert_ok((long) fresh, "mmap");
+			count_event(&(thread_stats()->mmaps), 1);
+			// another arena may have put one in first, then use that one
+			if (__atomic_compare_exchange_n(&(page_map[top]), &leaf, fresh,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				leaf = fresh;
+			} else {
+				assert_ok(munmap(fresh, PAGE_MAP_LEAF), "munmap");
+				count_event(&(thread_stats()->munmaps), 1);
+			}
+		}
+		leaf[page % PAGE_MAP_LEAF] = kind;
+	}
+}
+
+// fork only copies the thread that calls it, so a lock some other thread
+// held would stay locked in the child forever. Every lock is taken before
+// the fork, in the order they nest, so the heap is copied between
+// operations; the parent lets go of them and the child starts them over
+void
+fork_prepare()
+{
+	pthread_mutex_lock(&profile_lock);
+	pthread_mutex_lock(&guard_lock);
+	for (int ii = 0; ii < num_arenas; ii++) {
+		pthread_mutex_lock(&(arenas[ii].lock));
+	}
+	pthread_mutex_lock(&huge_lock);
+}
+
+void
+fork_parent()
+{
+	pthread_mutex_unlock(&huge_lock);
+	for (int ii = 0; ii < num_arenas; ii++) {
+		pthread_mutex_unlock(&(arenas[ii].lock));
+	}
+	pthread_mutex_unlock(&guard_lock);
+	pthread_mutex_unlock(&profile_lock);
+}
+
+void
+fork_child()
+{
+	pthread_mutex_init(&huge_lock, 0);
+	for (int ii = 0; ii < num_arenas; ii++) {
+		pthread_mutex_init(&(arenas[ii].lock), 0);
+	}
+	pthread_mutex_init(&guard_lock, 0);
+	pthread_mutex_init(&profile_lock, 0);
+}
+
+// one arena per online cpu, unless OPT_MALLOC_ARENAS says otherwise
+void
+init_arenas()
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	char* env = getenv("OPT_MALLOC_ARENAS");
+	if (env) {
+		count = atol(env);
+	}
+	if (count < 1) {
+		count = 1;
+	}
+	if (count > MAX_ARENAS) {
+		count = MAX_ARENAS;
+	}
+	// mmap hands back zeroed, page aligned memory, so every bin starts empty
+	// and every arena starts on its own cache line
+	arena* all = mmap(NULL, count * sizeof(arena), PROT_READ|PROT_WRITE,
+	MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert_ok((long) all, "mmap");
+	for (int ii = 0; ii < count; ii++) {
+		pthread_mutex_init(&(all[ii].lock), 0);
+	}
+	arenas = all;
+	num_arenas = count;
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+
+	env = getenv("OPT_MALLOC_RETAIN");
+	if (env) {
+		retain_slabs = atoi(env);
+		if (retain_slabs < 0) {
+			retain_slabs = 0;
+		}
+		if (retain_slabs > SLAB_CACHE_SLOTS) {
+			retain_slabs = SLAB_CACHE_SLOTS;
+		}
+	}
+	env = getenv("OPT_MALLOC_DECAY_MS");
+	if (env) {
+		decay_ms = atol(env);
+	}
+	env = getenv("OPT_MALLOC_THP");
+	if (env) {
+		use_thp = atoi(env);
+	}
+	env = getenv("OPT_MALLOC_HUGE_CACHE");
+	if (env) {
+		huge_cache_limit = atol(env);
+	}
+	env = getenv("OPT_MALLOC_GUARD_SAMPLE");
+	if (env) {
+		guard_sample = atol(env);
+	}
+	env = getenv("OPT_MALLOC_GUARD_SLOTS");
+	if (env) {
+		guard_slots = atoi(env);
+		if (guard_slots < 1) {
+			guard_slots = 1;
+		}
+	}
+	env = getenv("OPT_MALLOC_PROFILE");
+	if (env && *env) {
+		profile_prefix = env;
+	}
+	env = getenv("OPT_MALLOC_PROFILE_RATE");
+	if (env && atol(env) > 0) {
+		profile_rate = atol(env);
+	}
+	env = getenv("OPT_MALLOC_PROFILE_SIGNAL");
+	if (env) {
+		profile_signal = atoi(env);
+	}
+	env = getenv("OPT_MALLOC_PROFILE_FORMAT");
+	if (env) {
+		profile_folded = strcmp(env, "folded") == 0;
+	}
+}
+
+// gets the arena of the calling thread, handing out arenas round robin the
+// first time a thread shows up so threads spread evenly over the cpus
+int
+get_thread_arena()
+{
+	if (thread_arena < 0) {
+		pthread_once(&arenas_once, init_arenas);
+		int ticket = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+		thread_arena = ticket % num_arenas;
+	}
+	return thread_arena;
+}
+
+// counters of the arena of the calling thread, where the work that belongs
+// to no arena in particular (mapping memory, huge blocks) is counted
+arena_stats*
+thread_stats()
+{
+	// arenas may not exist until get_thread_arena sets them up
+	int tidx = get_thread_arena();
+	return &(arenas[tidx].stats);
+}
+
+void
+count_event(size_t* counter, size_t amount)
+{
+	__atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+void
+lock_arena(arena* ar)
+{
+	pthread_mutex_lock(&(ar->lock));
+	ar->stats.lock_acquisitions++;
+}
+
+void
+lock_huge()
+{
+	pthread_mutex_lock(&huge_lock);
+	count_event(&(thread_stats()->lock_acquisitions), 1);
+}
+
 // gets the smallest bucket able to hold to the given size or return -1
 int
 find_bucket_index(size_t size)
 {
-	int ii = 0;
-	while(ii < 18) {
-		if (size <= sizes[ii]) {
-			return ii;
-		}
-		ii++;
+	if (size > BIGGEST_SIZE) {
+		return -1;
 	}
-	return -1;
+	return class_lookup[(size + LOOKUP_GRAIN - 1) / LOOKUP_GRAIN];
 }
 
 // gets the block size of the bucket at the given index
 size_t
 find_bucket_size(int idx)
 {
-	if (idx < 0 || idx >= 18) {
+	if (idx < 0 || idx >= NUM_CLASSES) {
 		return -1;
 	}
 	return sizes[idx];
 
 }
 
-// gets the header of the page that holds the given ptr
+// gets the length in bytes of the slabs of the bucket at the given index
+size_t
+find_slab_size(int idx)
+{
+	return slab_pages[idx] * PAGE_SIZE;
+}
+
+// gets the header of the slab that holds the given ptr
 uintptr_t
 find_closest_pointer(uintptr_t ptr)
 {
-	// Round down to closest 4096-byte boundary
-	return ptr &= -PAGE_SIZE;
+	// Round down to the segment, which knows where the slab starts
+	segment* seg = (segment*) (ptr & -SEGMENT_SIZE);
+	int page = (ptr - (uintptr_t) seg) / PAGE_SIZE;
+	return (uintptr_t) seg + seg->slab_start[page] * PAGE_SIZE;
 }
 
 
 int
-amount_of_blocks(size_t bytes)
+amount_of_blocks(int bucket)
 {
-	//4096 - 92 because part of the page contains metadata
-	int size = PAGE_SIZE - sizeof(page_header);
+	// part of the slab contains metadata
+	int size = find_slab_size(bucket) - sizeof(page_header);
 	// integer divison rounds down so we good
-	return size / bytes;
+	return size / sizes[bucket];
 
 }
 
+void release_cached_memory(int held);
 
-void toggle_bitmap(page_header* header, int idx)
+// maps length bytes, and if the address space is out (say an RLIMIT_AS),
+// gives back every cached span and mapping before it tries once more.
+// held is the arena whose lock the caller holds, or -1. Returns 0 when
+// there is no memory even then
+void*
+map_memory(size_t length, int held)
 {
-	int num = idx / BITS_PER_INT;
-	int b_idx = idx % BITS_PER_INT;
-	header->bitmap[num] ^= (1 << b_idx);
+	void* mem = mmap(NULL, length, PROT_READ|PROT_WRITE,
+	MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED && errno == ENOMEM) {
+		release_cached_memory(held);
+		mem = mmap(NULL, length, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	}
+	count_event(&(thread_stats()->mmaps), 1);
+	return mem == MAP_FAILED ? 0 : mem;
 }
 
-
-page_header*
-init_header(size_t bytes, page_header* passed, int tidx, int bucketidx)
+// maps length bytes starting on a multiple of align, by mapping enough to be
+// sure one is inside and trimming the rest off
+void*
+map_aligned(size_t length, size_t align, int held)
 {
-	//TODO: add case where we set next to a another page header
-	page_header* header = mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE,
-	MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-	assert_ok((long) header, "mmap");
-	header->size = bytes;
-	header->tidx = tidx;
-	int amount = amount_of_blocks(bytes);
-	int extra = (BITS_PER_INT * BITMAP_LENGTH) - amount;
-	int leftover = extra / BITS_PER_INT + (extra % BITS_PER_INT != 0);
-	int idx_bad = BITMAP_LENGTH - leftover;
-
-	for (int i = 0; i < idx_bad; i++) {
-		// set every int to all 1
-		header->bitmap[i] = 0;
+	size_t padded = length + align - PAGE_SIZE;
+	void* raw = map_memory(padded, held);
+	if (raw == 0) {
+		return 0;
 	}
-
-	for (int i = idx_bad; i < BITMAP_LENGTH; i++) {
-		// set every int to all 1
-		header->bitmap[i] = -1;
+	uintptr_t start = ((uintptr_t) raw + align - 1) & -align;
+	size_t head = start - (uintptr_t) raw;
+	size_t tail = padded - head - length;
+	if (head) {
+		assert_ok(munmap(raw, head), "munmap");
+		count_event(&(thread_stats()->munmaps), 1);
 	}
-	int start = BITS_PER_INT * idx_bad;
-	// 0 is free, 1 is full/unusable
-	for (int j = start; j < amount; j++) {
-		toggle_bitmap(header, j);
+	if (tail) {
+		assert_ok(munmap((void*) (start + length), tail), "munmap");
+		count_event(&(thread_stats()->munmaps), 1);
 	}
+	return (void*) start;
+}
 
-	header->next = 0;
-	if (passed == 0) {
-		header->prev = 0;
-		// this is first one, put in spot in bin
-		bins[bucketidx][tidx] = header;
-	} else {
-		header->prev = passed;
-		passed->next = header;
+void
+link_segment(segment* seg)
+{
+	segment** list = &(arenas[seg->tidx].segments);
+	seg->prev = 0;
+	seg->next = *list;
+	if (seg->next) {
+		(seg->next)->prev = seg;
 	}
-
-	return header;
-
+	*list = seg;
 }
 
-// essentially 0 if no space or header not initalized, otherwise
-// returns pointer to first page_header that has space
-page_header*
-get_usable_header(page_header* header) {
-	// if we pass it empty bin, get empty bin back
-	if (header == 0) {
-		return 0;
+void
+unlink_segment(segment* seg)
+{
+	if (seg->prev == 0) {
+		arenas[seg->tidx].segments = seg->next;
+	} else {
+		(seg->prev)->next = seg->next;
 	}
-	for (int ii = 0; ii < BITMAP_LENGTH; ii++) {
-		if (header->bitmap[ii] != -1) {
-			return header;
-		}
+	if (seg->next) {
+		(seg->next)->prev = seg->prev;
 	}
-	if (header->next) {
-		return get_usable_header(header->next);
-	} else {
+}
+
+// reserves a new segment for the arena, page 0 holds the segment header
+segment*
+new_segment(int tidx)
+{
+	segment* seg = map_aligned(SEGMENT_SIZE, SEGMENT_SIZE, tidx);
+	if (seg == 0) {
 		return 0;
 	}
+	if (use_thp) {
+		// the segment is exactly one huge page and aligned to it
+		madvise(seg, SEGMENT_SIZE, MADV_HUGEPAGE);
+	}
+	seg->used[0] = 1;
+	seg->used_pages = 1;
+	seg->tidx = tidx;
+	link_segment(seg);
+	return seg;
 }
 
 int
-find_first_free(page_header* header)
+page_used(segment* seg, int page)
+{
+	return (seg->used[page / 64] >> (page % 64)) & 1;
+}
+
+// finds the first run of pages free pages in the segment, or -1
+int
+find_free_run(segment* seg, int pages)
 {
-	for(int ii = 0; ii < amount_of_blocks(header->size); ii++) {
-		int num = header->bitmap[ii / BITS_PER_INT];
-		int idx = ii % BITS_PER_INT;
-		if (num == -1) {
+	int start = 0;
+	while (start + pages <= SEGMENT_PAGES) {
+		uint64_t word = seg->used[start / 64] >> (start % 64);
+		if (word & 1) {
+			// skip the whole run of used pages in one go
+			start += __builtin_ctzll(~word);
 			continue;
-		} else if ((num >> idx) % 2 == 0) {
-			return ii;
 		}
+		int len = 1;
+		while (len < pages && !page_used(seg, start + len)) {
+			len++;
+		}
+		if (len == pages) {
+			return start;
+		}
+		start += len;
 	}
 	return -1;
 }
 
+// marks pages as part of the slab starting at page slab, or as free when
+// slab is -1
+void
+mark_pages(segment* seg, int start, int pages, int slab)
+{
+	for (int ii = start; ii < start + pages; ii++) {
+		if (slab >= 0) {
+			seg->used[ii / 64] |= 1ULL << (ii % 64);
+			seg->slab_start[ii] = slab;
+		} else {
+			seg->used[ii / 64] &= ~(1ULL << (ii % 64));
+		}
+	}
+	seg->used_pages += slab >= 0 ? pages : -pages;
+}
+
+// gets room for a slab of the given length from the segments of the arena,
+// reserving a new segment only when none of them has a long enough gap.
+// Returns 0 when that fails
 void*
-xmalloc(size_t bytes)
+reserve_pages(int tidx, int pages)
 {
-	
-	if (bytes > BIGGEST_SIZE) {
-		bytes += sizeof(special_page_header);
-		special_page_header* sph = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-		assert_ok((long) sph, "mmap");
-		sph->size = bytes;
-		// my birthday :)
-		sph->proof = 19405152000;
-		return ((void*) sph) + sizeof(special_page_header);
+	segment* seg = arenas[tidx].segments;
+	int start = -1;
+	for (; seg != 0; seg = seg->next) {
+		start = find_free_run(seg, pages);
+		if (start >= 0) {
+			break;
+		}
 	}
-	int tidx = rand() % 4;
-	pthread_mutex_lock(&(locks[tidx]));
-	// figure out which bucket to go to
-	int bucket = find_bucket_index(bytes);
-	page_header* header = get_usable_header(bins[bucket][tidx]);
-	// should be 80
-	size_t offset = sizeof(page_header);
-	// if there is no header with space
-	if (header == 0) {
-		header = init_header(find_bucket_size(bucket), header, tidx, bucket);
-		// since we now passing first block
-		toggle_bitmap(header, 0);
-		pthread_mutex_unlock(&(locks[tidx]));
-		return ((void*) header) + offset;
+	if (seg == 0) {
+		seg = new_segment(tidx);
+		if (seg == 0) {
+			return 0;
+		}
+		start = 1;
+	}
+	mark_pages(seg, start, pages, start);
+	if (seg->used_pages == SEGMENT_PAGES) {
+		unlink_segment(seg);
 	}
-	int first_free = find_first_free(header);
-	toggle_bitmap(header, first_free);
-	// we know there is at least 1 free space
-	pthread_mutex_unlock(&(locks[tidx]));
-	return ((void*) header) + offset + (first_free * header->size);
-	
+	return ((void*) seg) + start * PAGE_SIZE;
 }
 
+// gives a slab's pages back to its segment, and the segment back to the OS
+// once none of its pages hold a slab, must hold the arena lock
+void
+release_pages(void* slab, size_t length, int decayed)
+{
+	segment* seg = (segment*) ((uintptr_t) slab & -SEGMENT_SIZE);
+	int start = ((uintptr_t) slab - (uintptr_t) seg) / PAGE_SIZE;
+	if (seg->used_pages == SEGMENT_PAGES) {
+		link_segment(seg);
+	}
+	mark_pages(seg, start, length / PAGE_SIZE, -1);
+	set_page_kind(slab, length / PAGE_SIZE, PAGE_UNKNOWN);
+	if (seg->used_pages == 1) {
+		unlink_segment(seg);
+		assert_ok(munmap(seg, SEGMENT_SIZE), "munmap");
+		count_event(&(thread_stats()->munmaps), 1);
+	} else if (!decayed) {
+		assert_ok(madvise(slab, length, MADV_DONTNEED), "madvise");
+	}
+}
+
+// lengthens the span by more pages when the pages right after it in its
+// segment are free, returns whether it could, must hold the arena lock
 int
-can_remap(page_header* header) {
-	// amount of entries that are real
-	int numblocks = amount_of_blocks(header->size);
-	// extra entires that are default set to 1
-	int extra = (BITS_PER_INT * BITMAP_LENGTH) - numblocks;
-	int leftover = extra / BITS_PER_INT + (extra % BITS_PER_INT != 0);
-	int idx_bad = BITMAP_LENGTH - leftover;
-	// TODO: optimize this, there are plenty of ways
-	// if numblocks > extra then we can make sure first however many pages are 
-	for (int ii = 0; ii < idx_bad; ii++) {
-		if (header->bitmap[ii] != 0) {
+grow_span(void* span, int pages, int more)
+{
+	segment* seg = (segment*) ((uintptr_t) span & -SEGMENT_SIZE);
+	int start = ((uintptr_t) span - (uintptr_t) seg) / PAGE_SIZE;
+	if (start + pages + more > SEGMENT_PAGES) {
+		return 0;
+	}
+	for (int ii = start + pages; ii < start + pages + more; ii++) {
+		if (page_used(seg, ii)) {
 			return 0;
 		}
 	}
+	mark_pages(seg, start + pages, more, start);
+	set_page_kind(span + pages * PAGE_SIZE, more, PAGE_MEDIUM);
+	if (seg->used_pages == SEGMENT_PAGES) {
+		unlink_segment(seg);
+	}
+	return 1;
+}
 
-	int start = (idx_bad * BITS_PER_INT);
-	for (int ii = start; ii < numblocks; ii++) {
-		int num = header->bitmap[ii / BITS_PER_INT];
-		int idx = ii % BITS_PER_INT;
-		if ((num >> idx) % 2 != 0) {
-			return 0;
+long
+now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// gives back the memory of every slab that sat in the cache longer than
+// decay_ms, all in one pass, while keeping the mappings for reuse. Runs at
+// most every decay_ms / 2 so the clock is the only cost in between
+void
+decay_slab_cache(arena* ar, long now)
+{
+	if (now < ar->next_decay) {
+		return;
+	}
+	ar->next_decay = now + decay_ms / 2;
+	for (int ii = 0; ii < ar->cached_slabs; ii++) {
+		cached_slab* cs = &(ar->slab_cache[ii]);
+		if (!cs->decayed && now - cs->idle_since >= decay_ms) {
+			// MADV_DONTNEED rather than MADV_FREE so the RSS drops right away
+			assert_ok(madvise(cs->addr, cs->pages * PAGE_SIZE, MADV_DONTNEED), "madvise");
+			cs->decayed = 1;
 		}
 	}
+}
 
-	return 1;
+void
+drop_cached_slab(arena* ar, int ii)
+{
+	cached_slab* cs = &(ar->slab_cache[ii]);
+	release_pages(cs->addr, cs->pages * PAGE_SIZE, cs->decayed);
+	ar->cached_slabs--;
+	ar->slab_cache[ii] = ar->slab_cache[ar->cached_slabs];
+}
 
+// gets a run of pages to most pages long, the most recently emptied one
+// from the cache of the arena when there is one, must hold the arena lock.
+// Stores the length it got in got when that is not null, and in zeroed
+// whether the pages are all zero: pages of a segment that no slab holds
+// are either fresh or were madvised away, and so are decayed cached ones
+void*
+get_span(arena* ar, int pages, int most, int* got, int* zeroed)
+{
+	decay_slab_cache(ar, now_ms());
+	int best = -1;
+	for (int ii = 0; ii < ar->cached_slabs; ii++) {
+		cached_slab* cs = &(ar->slab_cache[ii]);
+		if (cs->pages < pages || cs->pages > most) {
+			continue;
+		}
+		if (best < 0 || cs->decayed < ar->slab_cache[best].decayed ||
+			(cs->decayed == ar->slab_cache[best].decayed &&
+			cs->idle_since > ar->slab_cache[best].idle_since)) {
+			best = ii;
+		}
+	}
+	if (best < 0) {
+		if (got) {
+			*got = pages;
+		}
+		*zeroed = 1;
+		return reserve_pages(ar - arenas, pages);
+	}
+	void* slab = ar->slab_cache[best].addr;
+	if (got) {
+		*got = ar->slab_cache[best].pages;
+	}
+	*zeroed = ar->slab_cache[best].decayed;
+	ar->cached_slabs--;
+	ar->slab_cache[best] = ar->slab_cache[ar->cached_slabs];
+	return slab;
 }
 
+// keeps an empty slab for reuse, unmapping the longest idle one when the
+// arena already holds retain_slabs of them, must hold the arena lock
 void
-xfree(void* ptr)
+put_slab(arena* ar, void* slab, int pages)
 {
-	void* ptr_b = ptr - sizeof(size_t);
-	size_t thesize = *((size_t*) ptr_b);
-	if (thesize == 19405152000) {
-		ptr_b -= sizeof(size_t);
-		size_t size = *((size_t*) ptr_b);
-		assert_ok(munmap(ptr_b, size), "munmap");
-		return;
+	long now = now_ms();
+	if (ar->cached_slabs >= retain_slabs) {
+		int oldest = -1;
+		for (int ii = 0; ii < ar->cached_slabs; ii++) {
+			if (oldest < 0 || ar->slab_cache[ii].idle_since < ar->slab_cache[oldest].idle_since) {
+				oldest = ii;
+			}
+		}
+		if (oldest < 0) {
+			release_pages(slab, pages * PAGE_SIZE, 0);
+			return;
+		}
+		drop_cached_slab(ar, oldest);
+	}
+	cached_slab* cs = &(ar->slab_cache[ar->cached_slabs]);
+	cs->addr = slab;
+	cs->pages = pages;
+	cs->decayed = 0;
+	cs->idle_since = now;
+	ar->cached_slabs++;
+	decay_slab_cache(ar, now);
+}
+
+void toggle_bitmap(page_header* header, int idx)
+{
+	int num = idx / BITS_PER_WORD;
+	int b_idx = idx % BITS_PER_WORD;
+	header->bitmap[num] ^= (1ULL << b_idx);
+}
+
+// marks a used block free again. One that is free already was freed
+// twice, and toggling it would quietly mark it used instead
+void
+mark_free(page_header* header, int idx)
+{
+	if (!(header->bitmap[idx / BITS_PER_WORD] & (1ULL << (idx % BITS_PER_WORD)))) {
+		fprintf(stderr, "xfree: double free of %p\n",
+			(void*) header + sizeof(page_header) + idx * header->size);
+		abort();
 	}
-	uintptr_t pt = find_closest_pointer((uintptr_t) ptr);
-	page_header* header = (page_header*) pt;
-	int tidx = header->tidx;
-	pthread_mutex_lock(&(locks[tidx]));
-	// to calculate index of spot to free
-	long idx = (((uintptr_t) ptr - pt) - sizeof(page_header)) / header->size;
-	// toggle the bitmap at that index
 	toggle_bitmap(header, idx);
-	if (can_remap(header)) {
-		int hdr_idx = find_bucket_index(header->size);
-		if (header->prev == 0) {
-			bins[hdr_idx][tidx] = header->next;
-			if (header->next) {
-				(header->next)->prev = 0;
-			}
+}
+
+// puts a page with free blocks at the front of its bin
+void
+link_header(page_header* header)
+{
+	page_header** bin = &(arenas[header->tidx].bins[header->bucket]);
+	header->prev = 0;
+	header->next = *bin;
+	if (header->next) {
+		(header->next)->prev = header;
+	}
+	*bin = header;
+}
+
+// takes a page out of its bin, once it is full or about to be unmapped
+void
+unlink_header(page_header* header)
+{
+	if (header->prev == 0) {
+		arenas[header->tidx].bins[header->bucket] = header->next;
+	} else {
+		(header->prev)->next = header->next;
+	}
+	if (header->next) {
+		(header->next)->prev = header->prev;
+	}
+	header->next = 0;
+	header->prev = 0;
+}
+
+page_header*
+init_header(size_t bytes, int tidx, int bucketidx)
+{
+	int pages = slab_pages[bucketidx];
+	int zeroed;
+	page_header* header = get_span(&(arenas[tidx]), pages, pages, 0, &zeroed);
+	if (header == 0) {
+		return 0;
+	}
+	set_page_kind(header, pages, 1 + bucketidx);
+	arenas[tidx].stats.pages[bucketidx] += pages;
+	header->size = bytes;
+	header->tidx = tidx;
+	header->bucket = bucketidx;
+	int amount = amount_of_blocks(bucketidx);
+	header->blocks = amount;
+	header->free_count = amount;
+	header->untouched = zeroed ? 0 : amount;
+
+	// 0 is free, 1 is full/unusable, so every bit past the last real block
+	// is set and the search never hands it out
+	for (int i = 0; i < BITMAP_LENGTH; i++) {
+		int first = i * BITS_PER_WORD;
+		if (amount <= first) {
+			header->bitmap[i] = -1ULL;
+		} else if (amount - first >= BITS_PER_WORD) {
+			header->bitmap[i] = 0;
 		} else {
-			(header->prev)->next = header->next;
-			if (header->next) {
-				(header->next)->prev = header->prev;
-			}
+			header->bitmap[i] = -1ULL << (amount - first);
 		}
-		assert_ok(munmap(header, PAGE_SIZE), "munmap");
-
 	}
-	pthread_mutex_unlock(&(locks[tidx]));
+
+	header->remote_free = 0;
+	link_header(header);
+	return header;
+
 }
 
-void*
-xrealloc(void* prev, size_t bytes)
+// pushes a block onto the remote free list of the page, without taking
+// any lock, for the owning arena to pick up later. A full page is in no bin,
+// so its owner would never look at the list: the first remote free to such
+// a page claims the PAGE_FULL mark and goes to the arena's delayed list,
+// which the owner checks on every xmalloc, instead
+void
+push_remote_free(page_header* header, void* ptr)
 {
-	uintptr_t pt = find_closest_pointer((uintptr_t) prev);
-	page_header* header = (page_header*) pt;
-	size_t size = header->size;
-	void* new_space = xmalloc(bytes);
-	memcpy(new_space, prev, size);
-	xfree(prev);
+	remote_block* block = ptr;
+	remote_block* head = __atomic_load_n(&(header->remote_free), __ATOMIC_RELAXED);
+	for (;;) {
+		if (head == PAGE_FULL) {
+			if (__atomic_compare_exchange_n(&(header->remote_free), &head, 0,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+			continue;
+		}
+		block->next = head;
+		if (__atomic_compare_exchange_n(&(header->remote_free), &head, block,
+			1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+
+	// the arena outlives all of its pages, so this is safe even if the
+	// owner frees the page the moment it sees the block
+	arena* ar = &(arenas[header->tidx]);
+	head = __atomic_load_n(&(ar->delayed_free), __ATOMIC_RELAXED);
+	do {
+		block->next = head;
+	} while (!__atomic_compare_exchange_n(&(ar->delayed_free), &head, block,
+		1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// a page with no block handed out leaves its bin for the slab cache, must
+// hold the lock of the owning arena
+void
+recycle_header(page_header* header)
+{
+	unlink_header(header);
+	arenas[header->tidx].stats.pages[header->bucket] -= slab_pages[header->bucket];
+	put_slab(&(arenas[header->tidx]), header, slab_pages[header->bucket]);
+}
+
+// takes every remotely freed block off the page in one swap and marks them
+// free in the bitmap, must hold the lock of the owning arena and the page
+// must be in its bin. Returns whether that emptied the page, which then
+// went back to the slab cache
+int
+drain_remote_frees(page_header* header)
+{
+	if (__atomic_load_n(&(header->remote_free), __ATOMIC_RELAXED) == 0) {
+		return 0;
+	}
+	remote_block* block = __atomic_exchange_n(&(header->remote_free), 0,
+		__ATOMIC_ACQUIRE);
+	while (block) {
+		remote_block* next = block->next;
+		long idx = (((uintptr_t) block - (uintptr_t) header) - sizeof(page_header)) / header->size;
+		mark_free(header, idx);
+		header->free_count++;
+		arenas[header->tidx].stats.frees[header->bucket]++;
+		block = next;
+	}
+	if (header->free_count == header->blocks) {
+		recycle_header(header);
+		return 1;
+	}
+	return 0;
+}
+
+// the last free block of the page was just handed out, so it leaves the
+// bin and gets the PAGE_FULL mark, unless remote frees came in meanwhile
+void
+retire_full_header(page_header* header)
+{
+	unlink_header(header);
+	remote_block* expected = 0;
+	if (!__atomic_compare_exchange_n(&(header->remote_free), &expected,
+		PAGE_FULL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		// someone already freed into it, it is not full anymore
+		link_header(header);
+		drain_remote_frees(header);
+	}
+}
+
+int
+find_first_free(page_header* header)
+{
+	for (int ii = 0; ii < BITMAP_LENGTH; ii++) {
+		uint64_t word = header->bitmap[ii];
+		if (word != -1ULL) {
+			return ii * BITS_PER_WORD + __builtin_ctzll(~word);
+		}
+	}
+	return -1;
+}
+
+// frees a block on a page of this arena, must hold the arena lock
+void
+free_local(page_header* header, void* ptr)
+{
+	// to calculate index of spot to free
+	long idx = (((uintptr_t) ptr - (uintptr_t) header) - sizeof(page_header)) / header->size;
+	// toggle the bitmap at that index
+	mark_free(header, idx);
+	header->free_count++;
+	arena_stats* st = &(arenas[header->tidx].stats);
+	st->frees[header->bucket]++;
+	if (header->free_count == 1) {
+		// it was full and out of the bin, clear the mark if no remote free
+		// took it already and give the page back to its bin
+		remote_block* expected = PAGE_FULL;
+		__atomic_compare_exchange_n(&(header->remote_free), &expected, 0,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		link_header(header);
+	}
+	if (header->free_count == header->blocks) {
+		recycle_header(header);
+	}
+}
+
+// frees every block other arenas sent while its page was full
+void
+drain_delayed_frees(arena* ar)
+{
+	if (__atomic_load_n(&(ar->delayed_free), __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	remote_block* block = __atomic_exchange_n(&(ar->delayed_free), 0,
+		__ATOMIC_ACQUIRE);
+	while (block) {
+		remote_block* next = block->next;
+		free_local((page_header*) find_closest_pointer((uintptr_t) block), block);
+		block = next;
+	}
+}
+
+// gets a span of whole pages for a block of medium size from the arena of
+// the thread, taking a cached span up to a quarter longer if there is one
+special_page_header*
+get_medium(size_t bytes)
+{
+	int tidx = get_thread_arena();
+	arena* ar = &(arenas[tidx]);
+	int pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+	int got = 0;
+	int zeroed;
+	lock_arena(ar);
+	special_page_header* sph = get_span(ar, pages, pages + pages / 4, &got, &zeroed);
+	if (sph == 0) {
+		pthread_mutex_unlock(&(ar->lock));
+		return 0;
+	}
+	set_page_kind(sph, got, PAGE_MEDIUM);
+	pthread_mutex_unlock(&(ar->lock));
+	sph->zeroed = zeroed;
+	sph->size = got * PAGE_SIZE;
+	sph->tidx = tidx;
+	sph->pages = got;
+	sph->start = sph;
+	return sph;
+}
+
+// medium spans go back to the cache of the arena that carved them out
+void
+put_medium(special_page_header* sph)
+{
+	arena* ar = &(arenas[sph->tidx]);
+	lock_arena(ar);
+	put_slab(ar, sph, sph->pages);
+	pthread_mutex_unlock(&(ar->lock));
+}
+
+void
+unmap_huge(void* addr, size_t length)
+{
+	set_page_kind(addr, 1, PAGE_UNKNOWN);
+	assert_ok(munmap(addr, length), "munmap");
+	count_event(&(thread_stats()->munmaps), 1);
+}
+
+// unmaps every cached huge block that was idle longer than decay_ms, must
+// hold huge_lock
+void
+decay_huge_cache(long now)
+{
+	for (int ii = 0; ii < cached_mappings; ii++) {
+		if (now - huge_cache[ii].idle_since >= decay_ms) {
+			unmap_huge(huge_cache[ii].addr, huge_cache[ii].length);
+			huge_cache_bytes -= huge_cache[ii].length;
+			cached_mappings--;
+			huge_cache[ii] = huge_cache[cached_mappings];
+			ii--;
+		}
+	}
+}
+
+// gets a mapping for a huge block, reusing the tightest cached one that is
+// at most a quarter longer than needed
+special_page_header*
+get_huge(size_t bytes)
+{
+	size_t length = (bytes + PAGE_SIZE - 1) & -PAGE_SIZE;
+	special_page_header* sph = 0;
+	int zeroed = 0;
+	lock_huge();
+	decay_huge_cache(now_ms());
+	int best = -1;
+	for (int ii = 0; ii < cached_mappings; ii++) {
+		size_t have = huge_cache[ii].length;
+		if (have >= length && have <= length + length / 4 &&
+			(best < 0 || have < huge_cache[best].length)) {
+			best = ii;
+		}
+	}
+	if (best >= 0) {
+		sph = huge_cache[best].addr;
+		length = huge_cache[best].length;
+		huge_cache_bytes -= length;
+		cached_mappings--;
+		huge_cache[best] = huge_cache[cached_mappings];
+	}
+	pthread_mutex_unlock(&huge_lock);
+	if (sph == 0) {
+		sph = map_memory(length, -1);
+		if (sph == 0) {
+			return 0;
+		}
+		zeroed = 1;
+		// the block pointer is always on the first page
+		set_page_kind(sph, 1, PAGE_HUGE);
+	}
+	sph->zeroed = zeroed;
+	sph->size = length;
+	sph->tidx = -1;
+	sph->pages = 0;
+	sph->start = sph;
+	return sph;
+}
+
+// keeps a freed huge block mapped when it fits in the cache, pushing out
+// the longest idle ones to make room
+void
+put_huge(void* addr, size_t length)
+{
+	if (length > huge_cache_limit) {
+		unmap_huge(addr, length);
+		return;
+	}
+	lock_huge();
+	long now = now_ms();
+	decay_huge_cache(now);
+	while (cached_mappings == HUGE_CACHE_SLOTS ||
+		huge_cache_bytes + length > huge_cache_limit) {
+		int oldest = 0;
+		for (int ii = 1; ii < cached_mappings; ii++) {
+			if (huge_cache[ii].idle_since < huge_cache[oldest].idle_since) {
+				oldest = ii;
+			}
+		}
+		unmap_huge(huge_cache[oldest].addr, huge_cache[oldest].length);
+		huge_cache_bytes -= huge_cache[oldest].length;
+		cached_mappings--;
+		huge_cache[oldest] = huge_cache[cached_mappings];
+	}
+	huge_cache[cached_mappings].addr = addr;
+	huge_cache[cached_mappings].length = length;
+	huge_cache[cached_mappings].idle_since = now;
+	cached_mappings++;
+	huge_cache_bytes += length;
+	pthread_mutex_unlock(&huge_lock);
+}
+
+// gets a medium span or a huge mapping of at least bytes, header included,
+// or 0 when the OS has no memory for it
+special_page_header*
+get_large(size_t bytes)
+{
+	special_page_header* sph;
+	if (bytes <= MEDIUM_MAX) {
+		sph = get_medium(bytes);
+	} else {
+		sph = get_huge(bytes);
+	}
+	if (sph == 0) {
+		return 0;
+	}
+	arena_stats* st = thread_stats();
+	count_event(&(st->large_allocs), 1);
+	count_event(&(st->large_bytes), sph->size);
+	return sph;
+}
+
+// takes up to count blocks of the given size class off the first page of
+// the bin of arena tidx, returns how many, must hold the arena lock. None
+// means a new slab could not be mapped. Stores in zeroed whether all of
+// them are known to be zero
+size_t
+take_blocks(int tidx, int bucket, size_t count, void** out, int* zeroed)
+{
+	arena* ar = &(arenas[tidx]);
+	// every page in the bin has at least one free block, pages that remote
+	// frees emptied go back to the slab cache on the way
+	page_header* header = ar->bins[bucket];
+	while (header && drain_remote_frees(header)) {
+		header = ar->bins[bucket];
+	}
+	if (header == 0) {
+		header = init_header(find_bucket_size(bucket), tidx, bucket);
+	}
+	size_t got = 0;
+	*zeroed = 1;
+	if (header == 0) {
+		return 0;
+	}
+	while (got < count && header->free_count > 0) {
+		int first_free = find_first_free(header);
+		// the first free block is never past the untouched ones
+		if (first_free == header->untouched) {
+			header->untouched++;
+		} else {
+			*zeroed = 0;
+		}
+		toggle_bitmap(header, first_free);
+		header->free_count--;
+		out[got++] = ((void*) header) + sizeof(page_header) + (first_free * header->size);
+	}
+	if (header->free_count == 0) {
+		retire_full_header(header);
+	}
+	ar->stats.allocs[bucket] += got;
+	return got;
+}
+
+// hands out a block of the given size class from the arena of the thread
+void*
+alloc_small(int bucket, int* zeroed)
+{
+	int tidx = get_thread_arena();
+	arena* ar = &(arenas[tidx]);
+	void* block = 0;
+	lock_arena(ar);
+	drain_delayed_frees(ar);
+	take_blocks(tidx, bucket, 1, &block, zeroed);
+	pthread_mutex_unlock(&(ar->lock));
+	return block;
+}
+
+// Sampled guarded allocations, the way GWP-ASan does them. With
+// OPT_MALLOC_GUARD_SAMPLE set, about one small xmalloc in that many gets a
+// page of its own in the guard pool, where every slot page sits between
+// two PROT_NONE guard pages and the block ends right at the next one, so
+// running off its end faults. A freed slot goes PROT_NONE too and stays in
+// quarantine until it is the oldest one free, so touching it faults and
+// freeing it again is caught. A fault in the pool prints what the block was
+// and where it came from before the process dies on the SIGSEGV. Every
+// other xmalloc only pays for counting down a thread local.
+
+// the slot a pointer into the pool belongs to, and for a guard page the
+// one in front of it, whose block it is the end of
+guard_slot*
+guard_slot_of(void* ptr)
+{
+	long page = ((char*) ptr - guard_pool) / PAGE_SIZE;
+	long slot = page % 2 ? page / 2 : page / 2 - 1;
+	return slot >= 0 && slot < guard_slots ? &(guard_table[slot]) : 0;
+}
+
+char*
+guard_slot_page(guard_slot* slot)
+{
+	return guard_pool + (2 * (slot - guard_table) + 1) * PAGE_SIZE;
+}
+
+int
+in_guard_pool(void* ptr)
+{
+	return (char*) ptr >= guard_pool && (char*) ptr < guard_pool + guard_length;
+}
+
+// writes a report to stderr without allocating, so it works from the
+// SIGSEGV handler and with the heap in any state
+void
+guard_report(const char* fmt, ...)
+{
+	char buf[512];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (len > (int) sizeof(buf) - 1) {
+		len = sizeof(buf) - 1;
+	}
+	if (write(2, buf, len) < 0) {
+		return;
+	}
+}
+
+void
+guard_segv(int sig, siginfo_t* info, void* context)
+{
+	char* addr = info->si_addr;
+	if (guard_pool == 0 || !in_guard_pool(addr)) {
+		// not ours, pass it on to whoever had SIGSEGV before
+		if (old_segv.sa_flags & SA_SIGINFO) {
+			old_segv.sa_sigaction(sig, info, context);
+		} else if (old_segv.sa_handler != SIG_DFL && old_segv.sa_handler != SIG_IGN) {
+			old_segv.sa_handler(sig);
+		} else {
+			signal(SIGSEGV, SIG_DFL);
+		}
+		return;
+	}
+	long page = (addr - guard_pool) / PAGE_SIZE;
+	guard_slot* slot = guard_slot_of(addr);
+	if (page % 2 == 0 && slot && slot->live) {
+		guard_report("xmalloc: heap buffer overflow at %p, %ld bytes past the "
+			"%zu byte block at %p allocated from %p\n", addr,
+			(long) (addr - (char*) slot->ptr - slot->size), slot->size,
+			slot->ptr, slot->alloc_site);
+	} else if (page % 2 == 1 && slot->ptr && !slot->live) {
+		guard_report("xmalloc: use after free at %p, %ld bytes into the %zu "
+			"byte block at %p allocated from %p and freed from %p\n", addr,
+			(long) (addr - (char*) slot->ptr), slot->size, slot->ptr,
+			slot->alloc_site, slot->free_site);
+	} else {
+		guard_report("xmalloc: wild access to the guard pool at %p\n", addr);
+	}
+	// the access faults again once this returns, and kills the process
+	signal(SIGSEGV, SIG_DFL);
+}
+
+// maps the pool, all of it PROT_NONE until a slot is handed out
+void
+init_guard_pool()
+{
+	guard_length = (2 * guard_slots + 1) * PAGE_SIZE;
+	char* pool = mmap(NULL, guard_length, PROT_NONE,
+	MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	assert_ok((long) pool, "mmap");
+	guard_slot* table = mmap(NULL, guard_slots * sizeof(guard_slot),
+	PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert_ok((long) table, "mmap");
+	count_event(&(thread_stats()->mmaps), 2);
+	set_page_kind(pool, guard_length / PAGE_SIZE, PAGE_GUARDED);
+	guard_table = table;
+	guard_pool = pool;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = guard_segv;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &old_segv);
+}
+
+// puts a block of bytes at the end of a slot page, or returns 0 when every
+// slot is live. Blocks stay 16 byte aligned, so up to 15 bytes of overflow
+// land in the slot and go unnoticed
+void*
+guarded_alloc(size_t bytes, void* site)
+{
+	pthread_mutex_lock(&guard_lock);
+	guard_slot* pick = 0;
+	for (int ii = 0; ii < guard_slots; ii++) {
+		guard_slot* slot = &(guard_table[ii]);
+		if (slot->ptr == 0) {
+			pick = slot;
+			break;
+		}
+		if (!slot->live && (pick == 0 || slot->freed_at < pick->freed_at)) {
+			pick = slot;
+		}
+	}
+	if (pick == 0) {
+		pthread_mutex_unlock(&guard_lock);
+		return 0;
+	}
+	char* page = guard_slot_page(pick);
+	assert_ok(mprotect(page, PAGE_SIZE, PROT_READ|PROT_WRITE), "mprotect");
+	size_t length = bytes ? (bytes + 15) & -16 : 16;
+	pick->ptr = page + PAGE_SIZE - length;
+	pick->size = bytes;
+	pick->live = 1;
+	pick->alloc_site = site;
+	pick->free_site = 0;
+	pthread_mutex_unlock(&guard_lock);
+	return pick->ptr;
+}
+
+void
+guarded_free(void* ptr, void* site)
+{
+	pthread_mutex_lock(&guard_lock);
+	guard_slot* slot = guard_slot_of(ptr);
+	if (slot == 0 || slot->ptr == 0 || (char*) ptr < guard_slot_page(slot)
+		|| (char*) ptr >= guard_slot_page(slot) + PAGE_SIZE) {
+		guard_report("xfree: %p was not allocated by xmalloc\n", ptr);
+		abort();
+	}
+	if (!slot->live) {
+		guard_report("xfree: double free of the %zu byte block at %p allocated "
+			"from %p, first freed from %p and again from %p\n", slot->size,
+			slot->ptr, slot->alloc_site, slot->free_site, site);
+		abort();
+	}
+	if (ptr != slot->ptr) {
+		guard_report("xfree: %p is %ld bytes into the %zu byte block at %p "
+			"allocated from %p\n", ptr, (long) ((char*) ptr - (char*) slot->ptr),
+			slot->size, slot->ptr, slot->alloc_site);
+		abort();
+	}
+	char* page = guard_slot_page(slot);
+	// the memory goes back, the address range stays reserved
+	madvise(page, PAGE_SIZE, MADV_DONTNEED);
+	assert_ok(mprotect(page, PAGE_SIZE, PROT_NONE), "mprotect");
+	slot->live = 0;
+	slot->freed_at = ++guard_frees;
+	slot->free_site = site;
+	pthread_mutex_unlock(&guard_lock);
+}
+
+size_t
+guarded_usable_size(void* ptr)
+{
+	guard_slot* slot = guard_slot_of(ptr);
+	return guard_slot_page(slot) + PAGE_SIZE - (char*) ptr;
+}
+
+// where the countdown of xmalloc runs out: starts the next one, a random
+// length averaging guard_sample so allocation patterns can't hide from it,
+// and gives this call a guarded block if it can
+void*
+guard_tick(size_t bytes, void* site)
+{
+	pthread_once(&arenas_once, init_arenas);
+	if (guard_sample <= 0) {
+		guard_countdown = LONG_MAX;
+		return 0;
+	}
+	pthread_once(&guard_once, init_guard_pool);
+	int first = guard_rng == 0;
+	if (first) {
+		guard_rng = (uintptr_t) &guard_rng | 1;
+	}
+	guard_rng ^= guard_rng << 13;
+	guard_rng ^= guard_rng >> 7;
+	guard_rng ^= guard_rng << 17;
+	guard_countdown = 1 + guard_rng % (2 * guard_sample - 1);
+	// a thread's first call starts its countdown, and counts as its first step
+	if (first && guard_countdown > 1) {
+		guard_countdown--;
+		return 0;
+	}
+	if (bytes > PAGE_SIZE) {
+		return 0;
+	}
+	return guarded_alloc(bytes, site);
+}
+
+// The heap profiler. Like tcmalloc's, it samples by bytes: the gaps
+// between samples are drawn from an exponential distribution averaging
+// profile_rate bytes, so a block of n bytes is sampled with probability
+// 1 - exp(-n / profile_rate) whatever the allocation pattern, and a
+// profile can be scaled back up to the whole heap. Every sample keeps the
+// call stack of its xmalloc until it is freed. Every other xmalloc only
+// pays for counting down a thread local, and every xfree for a look at
+// profile_filter once the profiler is on.
+
+uint64_t
+profile_hash(void* ptr)
+{
+	return ((uintptr_t) ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+uint64_t
+profile_random()
+{
+	if (profile_rng == 0) {
+		profile_rng = ((uintptr_t) &profile_rng ^ (uint64_t) time(0) << 32) | 1;
+	}
+	profile_rng ^= profile_rng << 13;
+	profile_rng ^= profile_rng >> 7;
+	profile_rng ^= profile_rng << 17;
+	return profile_rng;
+}
+
+// bytes until the next sample
+long
+profile_interval()
+{
+	// uniform in (0, 1], 53 bits of it
+	double uu = ((profile_random() >> 11) + 1) / 9007199254740992.0;
+	double gap = -log(uu) * profile_rate;
+	return gap < 1 ? 1 : gap > LONG_MAX / 2 ? LONG_MAX / 2 : (long) gap;
+}
+
+// how much of the heap a stack's live samples stand for, the way pprof
+// scales a heap_v2 profile
+double
+profile_scale(profile_stack* st)
+{
+	if (st->live == 0) {
+		return 0;
+	}
+	double avg = (double) st->live_bytes / st->live;
+	return 1 / (1 - exp(-avg / profile_rate));
+}
+
+// writes the next profile, must hold profile_lock. The legacy heap format
+// of gperftools is what pprof reads, with the memory map behind it so it
+// can symbolize. Folded stacks, outermost frame first with the estimated
+// live bytes, are what flamegraph.pl reads
+void
+profile_dump()
+{
+	static out_buf out;
+	char path[4096];
+	snprintf(path, sizeof(path), "%s.%d.%04d.%s", profile_prefix, (int) getpid(),
+		profile_dumps++, profile_folded ? "folded" : "heap");
+	out.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	out.used = 0;
+	if (out.fd < 0) {
+		guard_report("xmalloc: can't write the heap profile to %s\n", path);
+		return;
+	}
+	if (!profile_folded) {
+		profile_stack total;
+		memset(&total, 0, sizeof(total));
+		for (int ii = 0; ii < PROFILE_STACKS; ii++) {
+			profile_stack* st = &(profile_stacks[ii]);
+			total.live += st->live;
+			total.live_bytes += st->live_bytes;
+			total.allocs += st->allocs;
+			total.alloc_bytes += st->alloc_bytes;
+		}
+		out_put(&out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%ld\n",
+			total.live, total.live_bytes, total.allocs, total.alloc_bytes,
+			profile_rate);
+	}
+	for (int ii = 0; ii < PROFILE_STACKS; ii++) {
+		profile_stack* st = &(profile_stacks[ii]);
+		if (st->hash == 0) {
+			continue;
+		}
+		if (profile_folded) {
+			if (st->live == 0) {
+				continue;
+			}
+			for (int ff = st->depth - 1; ff >= 0; ff--) {
+				out_put(&out, "%p%s", st->frames[ff], ff ? ";" : "");
+			}
+			out_put(&out, " %.0f\n", st->live_bytes * profile_scale(st));
+			continue;
+		}
+		out_put(&out, "%zu: %zu [%zu: %zu] @", st->live, st->live_bytes,
+			st->allocs, st->alloc_bytes);
+		for (int ff = 0; ff < st->depth; ff++) {
+			out_put(&out, " %p", st->frames[ff]);
+		}
+		out_put(&out, "\n");
+	}
+	if (!profile_folded) {
+		out_put(&out, "\nMAPPED_LIBRARIES:\n");
+		out_flush(&out);
+		int maps = open("/proc/self/maps", O_RDONLY);
+		ssize_t got;
+		while (maps >= 0 && (got = read(maps, out.data, sizeof(out.data))) > 0) {
+			out.used = got;
+			out_flush(&out);
+		}
+		if (maps >= 0) {
+			close(maps);
+		}
+	}
+	out_flush(&out);
+	close(out.fd);
+	if (profile_dropped) {
+		guard_report("xmalloc: %zu samples did not fit in the heap profile\n",
+			profile_dropped);
+	}
+}
+
+void
+profile_unlock()
+{
+	if (profile_pending) {
+		profile_pending = 0;
+		profile_dump();
+	}
+	pthread_mutex_unlock(&profile_lock);
+}
+
+// OPT_MALLOC_PROFILE_SIGNAL asks for a profile. Writing one takes locks and
+// formats with stdio, none of which is safe in a handler, so the handler
+// only leaves a note for profile_unlock
+void
+profile_on_signal(int sig)
+{
+	profile_pending = 1;
+}
+
+void
+profile_at_exit()
+{
+	pthread_mutex_lock(&profile_lock);
+	profile_dump();
+	pthread_mutex_unlock(&profile_lock);
+}
+
+void
+init_profile()
+{
+	profile_stacks = mmap(NULL, PROFILE_STACKS * sizeof(profile_stack),
+	PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	assert_ok((long) profile_stacks, "mmap");
+	profile_objects = mmap(NULL, PROFILE_OBJECTS * sizeof(profile_object),
+	PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	assert_ok((long) profile_objects, "mmap");
+	uint16_t* filter = mmap(NULL, PROFILE_FILTER * sizeof(uint16_t),
+	PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert_ok((long) filter, "mmap");
+	count_event(&(thread_stats()->mmaps), 3);
+	// the first backtrace loads the unwinder, which allocates, so it
+	// happens here and not in the middle of a sample
+	void* frames[2];
+	backtrace(frames, 2);
+	if (profile_signal > 0) {
+		signal(profile_signal, profile_on_signal);
+	}
+	atexit(profile_at_exit);
+	__atomic_store_n(&profile_filter, filter, __ATOMIC_RELEASE);
+}
+
+profile_stack*
+profile_find_stack(void** frames, int depth)
+{
+	uint64_t hash = 0;
+	for (int ii = 0; ii < depth; ii++) {
+		hash = (hash ^ profile_hash(frames[ii])) * 0x100000001b3ULL;
+	}
+	hash |= 1;
+	for (int probe = 0; probe < PROFILE_STACKS; probe++) {
+		profile_stack* st = &(profile_stacks[(hash + probe) % PROFILE_STACKS]);
+		if (st->hash == 0) {
+			st->hash = hash;
+			st->depth = depth;
+			memcpy(st->frames, frames, depth * sizeof(void*));
+			return st;
+		}
+		if (st->hash == hash && st->depth == depth
+			&& memcmp(st->frames, frames, depth * sizeof(void*)) == 0) {
+			return st;
+		}
+	}
+	return 0;
+}
+
+// puts a live sample in the objects table, must hold profile_lock
+int
+profile_add_object(void* ptr, size_t bytes, profile_stack* st)
+{
+	uint64_t hash = profile_hash(ptr);
+	for (int probe = 0; probe < PROFILE_OBJECTS; probe++) {
+		profile_object* at = &(profile_objects[(hash + probe) % PROFILE_OBJECTS]);
+		if (at->ptr == 0) {
+			at->ptr = ptr;
+			at->size = bytes;
+			at->stack = st;
+			st->live++;
+			st->live_bytes += bytes;
+			__atomic_fetch_add(&(profile_filter[hash % PROFILE_FILTER]), 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// where the countdown of xmalloc runs out: starts the next one, and unless
+// this is the thread's first call, records the block it was counting down
+// to. Not inlined, so the frames to skip are this one and its caller
+__attribute__((noinline)) void
+profile_tick(void* ptr, size_t bytes)
+{
+	pthread_once(&arenas_once, init_arenas);
+	if (profile_prefix == 0) {
+		profile_countdown = LONG_MAX;
+		return;
+	}
+	pthread_once(&profile_once, init_profile);
+	int first = profile_rng == 0;
+	profile_countdown = profile_interval();
+	if (first) {
+		return;
+	}
+	void* frames[PROFILE_DEPTH + 2];
+	int depth = backtrace(frames, PROFILE_DEPTH + 2) - 2;
+	if (depth < 0) {
+		depth = 0;
+	}
+	pthread_mutex_lock(&profile_lock);
+	profile_stack* st = profile_find_stack(frames + 2, depth);
+	if (st && profile_add_object(ptr, bytes, st)) {
+		st->allocs++;
+		st->alloc_bytes += bytes;
+	} else {
+		profile_dropped++;
+	}
+	profile_unlock();
+}
+
+// finds the entry of a live sample, must hold profile_lock
+profile_object*
+profile_find_object(void* ptr)
+{
+	uint64_t hash = profile_hash(ptr);
+	for (int probe = 0; probe < PROFILE_OBJECTS; probe++) {
+		profile_object* at = &(profile_objects[(hash + probe) % PROFILE_OBJECTS]);
+		if (at->ptr == ptr) {
+			return at;
+		}
+		if (at->ptr == 0) {
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// takes a sample out of the objects table, shifting back the entries after
+// it that would not be found past the hole, must hold profile_lock
+void
+profile_remove_object(profile_object* obj)
+{
+	obj->stack->live--;
+	obj->stack->live_bytes -= obj->size;
+	__atomic_fetch_sub(&(profile_filter[profile_hash(obj->ptr) % PROFILE_FILTER]), 1,
+		__ATOMIC_RELAXED);
+	profile_object* hole = obj;
+	profile_object* at = obj;
+	for (;;) {
+		at = at + 1 == profile_objects + PROFILE_OBJECTS ? profile_objects : at + 1;
+		if (at->ptr == 0) {
+			break;
+		}
+		long home = profile_hash(at->ptr) % PROFILE_OBJECTS;
+		long gap = (hole - profile_objects - home + PROFILE_OBJECTS) % PROFILE_OBJECTS;
+		long dist = (at - profile_objects - home + PROFILE_OBJECTS) % PROFILE_OBJECTS;
+		if (gap <= dist) {
+			*hole = *at;
+			hole = at;
+		}
+	}
+	hole->ptr = 0;
+}
+
+// xfree of a block that may be a sample
+void
+profile_forget(void* ptr)
+{
+	if (__atomic_load_n(&(profile_filter[profile_hash(ptr) % PROFILE_FILTER]),
+		__ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	pthread_mutex_lock(&profile_lock);
+	profile_object* obj = profile_find_object(ptr);
+	if (obj) {
+		profile_remove_object(obj);
+	}
+	profile_unlock();
+}
+
+// xrealloc resized a block in place, or moved it without xmalloc and xfree
+void
+profile_resized(void* prev, void* ptr, size_t bytes)
+{
+	if (__atomic_load_n(&(profile_filter[profile_hash(prev) % PROFILE_FILTER]),
+		__ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	pthread_mutex_lock(&profile_lock);
+	profile_object* obj = profile_find_object(prev);
+	if (obj) {
+		profile_stack* st = obj->stack;
+		profile_remove_object(obj);
+		// there is room, an entry was just freed
+		profile_add_object(ptr, bytes, st);
+	}
+	profile_unlock();
+}
+
+// the block of xmalloc and xcalloc, site is the caller of those. Stores in
+// zeroed whether it is known to be all zero
+void*
+alloc_bytes(size_t bytes, int* zeroed, void* site)
+{
+	if (bytes > BIGGEST_SIZE) {
+		if (bytes > MAX_REQUEST) {
+			return 0;
+		}
+		special_page_header* sph = get_large(bytes + sizeof(special_page_header));
+		if (sph == 0) {
+			return 0;
+		}
+		*zeroed = sph->zeroed;
+		return ((void*) sph) + sizeof(special_page_header);
+	}
+	if (__builtin_expect(--guard_countdown <= 0, 0)) {
+		void* ptr = guard_tick(bytes, site);
+		if (ptr) {
+			// slot pages are fresh, or were madvised away by the last xfree
+			*zeroed = 1;
+			return ptr;
+		}
+	}
+	// figure out which bucket to go to
+	return alloc_small(find_bucket_index(bytes), zeroed);
+}
+
+void*
+xmalloc(size_t bytes)
+{
+	int zeroed;
+	void* ptr = alloc_bytes(bytes, &zeroed, __builtin_return_address(0));
+	if (ptr == 0) {
+		return 0;
+	}
+	if (__builtin_expect((profile_countdown -= bytes) < 0, 0)) {
+		profile_tick(ptr, bytes);
+	}
+	return ptr;
+}
+
+// count blocks of size bytes each, all zero. Memory fresh from the OS is
+// zero already, so only blocks that were used before get a memset, and a
+// big one costs its page faults and nothing more
+void*
+xcalloc(size_t count, size_t size)
+{
+	size_t bytes;
+	if (__builtin_mul_overflow(count, size, &bytes)) {
+		return 0;
+	}
+	int zeroed;
+	void* ptr = alloc_bytes(bytes, &zeroed, __builtin_return_address(0));
+	if (ptr == 0) {
+		return 0;
+	}
+	if (__builtin_expect((profile_countdown -= bytes) < 0, 0)) {
+		profile_tick(ptr, bytes);
+	}
+	if (!zeroed) {
+		memset(ptr, 0, bytes);
+	}
+	return ptr;
+}
+
+// frees a block of a size class
+void
+free_small(void* ptr)
+{
+	page_header* header = (page_header*) find_closest_pointer((uintptr_t) ptr);
+	int tidx = header->tidx;
+	// blocks of another arena go on the page's remote list instead of
+	// fighting the owner for its lock
+	if (tidx != get_thread_arena()) {
+		push_remote_free(header, ptr);
+		return;
+	}
+	lock_arena(&(arenas[tidx]));
+	free_local(header, ptr);
+	pthread_mutex_unlock(&(arenas[tidx].lock));
+}
+
+void
+xfree(void* ptr)
+{
+	if (ptr == 0) {
+		return;
+	}
+	if (__builtin_expect(profile_filter != 0, 0)) {
+		profile_forget(ptr);
+	}
+	int kind = page_kind(ptr);
+	if (kind == PAGE_GUARDED) {
+		guarded_free(ptr, __builtin_return_address(0));
+		return;
+	}
+	if (kind >= PAGE_MEDIUM) {
+		special_page_header* sph = ptr - sizeof(special_page_header);
+		arena_stats* st = thread_stats();
+		count_event(&(st->large_frees), 1);
+		count_event(&(st->large_bytes), -sph->size);
+		if (kind == PAGE_HUGE) {
+			// only the first page stays marked while the mapping is cached
+			size_t extra = ((uintptr_t) ptr - (uintptr_t) sph->start) / PAGE_SIZE;
+			if (extra) {
+				set_page_kind(((void*) sph->start) + PAGE_SIZE, extra, PAGE_UNKNOWN);
+			}
+			put_huge(sph->start, sph->size);
+		} else {
+			put_medium(sph->start);
+		}
+		return;
+	}
+	if (kind == PAGE_UNKNOWN) {
+		fprintf(stderr, "xfree: %p was not allocated by xmalloc\n", ptr);
+		abort();
+	}
+	free_small(ptr);
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+	int kind = page_kind(ptr);
+	if (kind == PAGE_UNKNOWN) {
+		return 0;
+	}
+	if (kind == PAGE_GUARDED) {
+		return guarded_usable_size(ptr);
+	}
+	if (kind >= PAGE_MEDIUM) {
+		special_page_header* sph = ptr - sizeof(special_page_header);
+		return ((uintptr_t) sph->start + sph->size) - (uintptr_t) ptr;
+	}
+	return sizes[kind - 1];
+}
+
+size_t
+release_slab_cache(arena* ar)
+{
+	size_t released = 0;
+	while (ar->cached_slabs > 0) {
+		// decayed slabs gave their memory back already
+		if (!ar->slab_cache[0].decayed) {
+			released += ar->slab_cache[0].pages * PAGE_SIZE;
+		}
+		drop_cached_slab(ar, 0);
+	}
+	return released;
+}
+
+size_t
+release_huge_cache()
+{
+	size_t released = 0;
+	lock_huge();
+	while (cached_mappings > 0) {
+		cached_mappings--;
+		released += huge_cache[cached_mappings].length;
+		unmap_huge(huge_cache[cached_mappings].addr,
+			huge_cache[cached_mappings].length);
+	}
+	huge_cache_bytes = 0;
+	pthread_mutex_unlock(&huge_lock);
+	return released;
+}
+
+// last resort when mmap fails, the caller may hold the lock of the held
+// arena, so the caches of the others are only emptied if they are free
+void
+release_cached_memory(int held)
+{
+	release_huge_cache();
+	for (int ii = 0; ii < num_arenas; ii++) {
+		if (ii == held) {
+			release_slab_cache(&(arenas[ii]));
+		} else if (pthread_mutex_trylock(&(arenas[ii].lock)) == 0) {
+			arenas[ii].stats.lock_acquisitions++;
+			release_slab_cache(&(arenas[ii]));
+			pthread_mutex_unlock(&(arenas[ii].lock));
+		}
+	}
+}
+
+size_t
+xmalloc_trim()
+{
+	size_t released = release_huge_cache();
+	for (int ii = 0; ii < num_arenas; ii++) {
+		arena* ar = &(arenas[ii]);
+		lock_arena(ar);
+		drain_delayed_frees(ar);
+		// pages deeper in the bins than take_blocks looks may have been
+		// emptied by other threads too
+		for (int bucket = 0; bucket < NUM_CLASSES; bucket++) {
+			page_header* header = ar->bins[bucket];
+			while (header) {
+				page_header* next = header->next;
+				drain_remote_frees(header);
+				header = next;
+			}
+		}
+		released += release_slab_cache(ar);
+		pthread_mutex_unlock(&(ar->lock));
+	}
+	return released;
+}
+
+// grows or shrinks a medium span where it is, returns whether it could
+int
+resize_medium(special_page_header* sph, size_t bytes)
+{
+	int pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+	arena* ar = &(arenas[sph->tidx]);
+	int ok = 1;
+	lock_arena(ar);
+	if (pages > sph->pages) {
+		ok = grow_span(sph, sph->pages, pages - sph->pages);
+	} else if (pages < sph->pages) {
+		// the tail goes straight back to the segment
+		release_pages(((void*) sph) + pages * PAGE_SIZE,
+			(sph->pages - pages) * PAGE_SIZE, 0);
+	}
+	if (ok) {
+		sph->pages = pages;
+		sph->size = pages * PAGE_SIZE;
+	}
+	pthread_mutex_unlock(&(ar->lock));
+	return ok;
+}
+
+// moves a huge block to a mapping of the new length with mremap, which
+// moves page table entries around instead of copying the data. Returns 0,
+// with the block left as it was, when there is no memory for it
+special_page_header*
+resize_huge(special_page_header* sph, size_t bytes)
+{
+	size_t length = (bytes + PAGE_SIZE - 1) & -PAGE_SIZE;
+	if (length == sph->size) {
+		return sph;
+	}
+	void* moved = mremap(sph, sph->size, length, MREMAP_MAYMOVE);
+	if (moved == MAP_FAILED && errno == ENOMEM) {
+		release_cached_memory(-1);
+		moved = mremap(sph, sph->size, length, MREMAP_MAYMOVE);
+	}
+	count_event(&(thread_stats()->mmaps), 1);
+	if (moved == MAP_FAILED) {
+		return 0;
+	}
+	if (moved != (void*) sph) {
+		set_page_kind(sph, 1, PAGE_UNKNOWN);
+		set_page_kind(moved, 1, PAGE_HUGE);
+	}
+	sph = moved;
+	sph->size = length;
+	sph->start = sph;
+	return sph;
+}
+
+// gets a block of bytes starting on a multiple of align, a power of two.
+// Slabs start on a page and their header is two cache lines, so up to that
+// alignment every block of a class that is a multiple of align is aligned
+// already. Anything else takes a span long enough to slide the block up to
+// the boundary and copies the header in front of it, marking every page up
+// to the block for a huge one so xfree finds it
+void*
+xmalloc_aligned(size_t bytes, size_t align)
+{
+	if (align <= 16) {
+		return xmalloc(bytes);
+	}
+	if (bytes > MAX_REQUEST || align > MAX_REQUEST - bytes) {
+		return 0;
+	}
+	void* ptr = 0;
+	int zeroed;
+	if (align <= sizeof(page_header) && bytes <= BIGGEST_SIZE) {
+		for (int bucket = find_bucket_index(bytes); bucket < NUM_CLASSES; bucket++) {
+			if (sizes[bucket] % align == 0) {
+				ptr = alloc_small(bucket, &zeroed);
+				break;
+			}
+		}
+	}
+	if (ptr == 0) {
+		special_page_header* sph = get_large(bytes + align + sizeof(special_page_header));
+		if (sph == 0) {
+			return 0;
+		}
+		uintptr_t block = ((uintptr_t) sph + sizeof(special_page_header) + align - 1) & -align;
+		special_page_header* copy = (void*) block - sizeof(special_page_header);
+		if (copy != sph) {
+			*copy = *sph;
+			if (sph->tidx < 0) {
+				set_page_kind(sph, (block - (uintptr_t) sph) / PAGE_SIZE + 1, PAGE_HUGE);
+			}
+		}
+		ptr = (void*) block;
+	}
+	if (__builtin_expect((profile_countdown -= bytes) < 0, 0)) {
+		profile_tick(ptr, bytes);
+	}
+	return ptr;
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+	if (prev == 0) {
+		return xmalloc(bytes);
+	}
+	if (bytes > MAX_REQUEST) {
+		return 0;
+	}
+	size_t size;
+	int kind = page_kind(prev);
+	if (kind == PAGE_GUARDED) {
+		// always moves, so the old block goes into quarantine
+		size = guarded_usable_size(prev);
+	} else if (kind >= PAGE_MEDIUM) {
+		special_page_header* sph = prev - sizeof(special_page_header);
+		size = xmalloc_usable_size(prev);
+		size_t need = bytes + sizeof(special_page_header);
+		size_t before = sph->size;
+		// stays too big for the size classes, try not to move or copy it,
+		// unless it is aligned and would lose its alignment
+		if (bytes > BIGGEST_SIZE && sph->start == sph) {
+			special_page_header* moved = 0;
+			if (sph->tidx < 0 && (moved = resize_huge(sph, need)) != 0) {
+				count_event(&(thread_stats()->large_bytes), moved->size - before);
+				if (profile_filter) {
+					profile_resized(prev, ((void*) moved) + sizeof(special_page_header), bytes);
+				}
+				return ((void*) moved) + sizeof(special_page_header);
+			}
+			if (sph->tidx >= 0 && need <= MEDIUM_MAX && resize_medium(sph, need)) {
+				count_event(&(thread_stats()->large_bytes), sph->size - before);
+				if (profile_filter) {
+					profile_resized(prev, prev, bytes);
+				}
+				return prev;
+			}
+		}
+	} else {
+		page_header* header = (page_header*) find_closest_pointer((uintptr_t) prev);
+		size = header->size;
+		// still fits, and would not fit a class of half the size or less
+		if (bytes <= size && bytes > size / 2) {
+			return prev;
+		}
+	}
+	if (size > bytes) {
+		size = bytes;
+	}
+	void* new_space = xmalloc(bytes);
+	if (new_space == 0) {
+		// the old block stays as it was, like realloc(3) leaves it
+		return 0;
+	}
+	memcpy(new_space, prev, size);
+	xfree(prev);
 	return new_space;
-}
\ No newline at end of file
+}
+
+void
+xmalloc_get_stats(xmalloc_stats* stats)
+{
+	pthread_once(&arenas_once, init_arenas);
+	memset(stats, 0, sizeof(xmalloc_stats));
+	stats->allocator = "opt";
+	stats->classes = NUM_CLASSES;
+	stats->arenas = num_arenas < XMALLOC_MAX_ARENAS ? num_arenas : XMALLOC_MAX_ARENAS;
+	for (int cc = 0; cc < NUM_CLASSES; cc++) {
+		stats->by_class[cc].size = sizes[cc];
+	}
+	size_t large_bytes = 0;
+	for (int ii = 0; ii < num_arenas; ii++) {
+		arena* ar = &(arenas[ii]);
+		// not lock_arena, looking should not show up in the counts
+		pthread_mutex_lock(&(ar->lock));
+		for (int cc = 0; cc < NUM_CLASSES; cc++) {
+			stats->by_class[cc].allocs += ar->stats.allocs[cc];
+			stats->by_class[cc].frees += ar->stats.frees[cc];
+			stats->by_class[cc].pages += ar->stats.pages[cc];
+		}
+		pthread_mutex_unlock(&(ar->lock));
+		xmalloc_arena_stats as;
+		as.mmaps = __atomic_load_n(&(ar->stats.mmaps), __ATOMIC_RELAXED);
+		as.munmaps = __atomic_load_n(&(ar->stats.munmaps), __ATOMIC_RELAXED);
+		as.large_allocs = __atomic_load_n(&(ar->stats.large_allocs), __ATOMIC_RELAXED);
+		as.lock_acquisitions = __atomic_load_n(&(ar->stats.lock_acquisitions), __ATOMIC_RELAXED);
+		if (ii < XMALLOC_MAX_ARENAS) {
+			stats->by_arena[ii] = as;
+		}
+		stats->mmaps += as.mmaps;
+		stats->munmaps += as.munmaps;
+		stats->large_allocs += as.large_allocs;
+		stats->lock_acquisitions += as.lock_acquisitions;
+		stats->allocs += as.large_allocs;
+		stats->frees += __atomic_load_n(&(ar->stats.large_frees), __ATOMIC_RELAXED);
+		large_bytes += __atomic_load_n(&(ar->stats.large_bytes), __ATOMIC_RELAXED);
+	}
+	stats->live_bytes = large_bytes;
+	for (int cc = 0; cc < NUM_CLASSES; cc++) {
+		xmalloc_class_stats* cs = &(stats->by_class[cc]);
+		// a remote free is only counted once its owner drains it
+		if (cs->frees < cs->allocs) {
+			cs->live_bytes = (cs->allocs - cs->frees) * cs->size;
+		}
+		stats->allocs += cs->allocs;
+		stats->frees += cs->frees;
+		stats->live_bytes += cs->live_bytes;
+	}
+}
+
+// fills out with count blocks of bytes each, taking the arena lock once
+// for all of them when they come from a size class
+size_t
+xmalloc_batch(size_t bytes, size_t count, void** out)
+{
+	if (bytes > BIGGEST_SIZE) {
+		for (size_t ii = 0; ii < count; ii++) {
+			out[ii] = xmalloc(bytes);
+			if (out[ii] == 0) {
+				return ii;
+			}
+		}
+		return count;
+	}
+	int bucket = find_bucket_index(bytes);
+	int tidx = get_thread_arena();
+	arena* ar = &(arenas[tidx]);
+	lock_arena(ar);
+	drain_delayed_frees(ar);
+	size_t got = 0;
+	int zeroed;
+	while (got < count) {
+		size_t more = take_blocks(tidx, bucket, count - got, out + got, &zeroed);
+		if (more == 0) {
+			break;
+		}
+		got += more;
+	}
+	pthread_mutex_unlock(&(ar->lock));
+	// the batch counts down as a whole, and its first block is the sample
+	if (got && __builtin_expect((profile_countdown -= bytes * got) < 0, 0)) {
+		profile_tick(out[0], bytes);
+	}
+	return got;
+}
+
+// frees count blocks, holding the lock of the thread's arena across all of
+// its own blocks instead of taking it once per block
+void
+xfree_batch(void** ptrs, size_t count)
+{
+	int tidx = get_thread_arena();
+	arena* ar = &(arenas[tidx]);
+	// samples are forgotten up front, profile_lock is never taken under an
+	// arena lock
+	if (__builtin_expect(profile_filter != 0, 0)) {
+		for (size_t ii = 0; ii < count; ii++) {
+			if (ptrs[ii]) {
+				profile_forget(ptrs[ii]);
+			}
+		}
+	}
+	int held = 0;
+	for (size_t ii = 0; ii < count; ii++) {
+		void* ptr = ptrs[ii];
+		if (ptr == 0) {
+			continue;
+		}
+		int kind = page_kind(ptr);
+		page_header* header = 0;
+		if (kind != PAGE_UNKNOWN && kind < PAGE_GUARDED) {
+			header = (page_header*) find_closest_pointer((uintptr_t) ptr);
+		}
+		if (header == 0 || header->tidx != tidx) {
+			// medium spans go back under the lock of their arena, which
+			// may well be this one
+			if (held) {
+				pthread_mutex_unlock(&(ar->lock));
+				held = 0;
+			}
+			xfree(ptr);
+			continue;
+		}
+		if (!held) {
+			lock_arena(ar);
+			held = 1;
+		}
+		free_local(header, ptr);
+	}
+	if (held) {
+		pthread_mutex_unlock(&(ar->lock));
+	}
+}
+
+// frees a block xmalloc or xrealloc gave out for bytes, which says whether
+// it is from a size class without a look at the page map. Not for blocks
+// of xmalloc_aligned, those may come from a bigger class than bytes says
+void
+xfree_sized(void* ptr, size_t bytes)
+{
+	if (ptr == 0) {
+		return;
+	}
+	if (bytes > BIGGEST_SIZE || in_guard_pool(ptr)) {
+		xfree(ptr);
+		return;
+	}
+	if (__builtin_expect(profile_filter != 0, 0)) {
+		profile_forget(ptr);
+	}
+	free_small(ptr);
+}
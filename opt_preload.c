@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include "xmalloc.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+// The C allocation API on top of xmalloc, built into libopt_malloc.so so
+// any program can be run on opt_malloc with
+//
+//   LD_PRELOAD=./libopt_malloc.so program
+//
+// The C++ operators are in opt_preload_new.cc. The library is built with
+// hidden visibility, so these are the only symbols it exports and nothing
+// a program defines can stand in for the allocator's own functions.
+#define EXPORT __attribute__((visibility("default")))
+
+// Memory for calls that come in while xmalloc is still setting itself up
+// on this thread (a libc function it uses calling malloc, say). It is
+// never given back, and there is very little of it, since only the first
+// call on the first thread ever needs it.
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(64)));
+static size_t bootstrap_used = 0;
+// how deep this thread is inside xmalloc, anything past 1 is a call from
+// inside the allocator
+static __thread int depth = 0;
+
+static void*
+bootstrap_alloc(size_t bytes)
+{
+	if (bytes > BOOTSTRAP_SIZE) {
+		return 0;
+	}
+	size_t length = (bytes + 15) & -16;
+	size_t at = __atomic_fetch_add(&bootstrap_used, length, __ATOMIC_RELAXED);
+	if (at + length > BOOTSTRAP_SIZE) {
+		return 0;
+	}
+	return bootstrap + at;
+}
+
+static int
+is_bootstrap(void* ptr)
+{
+	return (char*) ptr >= bootstrap && (char*) ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+EXPORT void*
+malloc(size_t bytes)
+{
+	if (depth > 0) {
+		return bootstrap_alloc(bytes);
+	}
+	depth++;
+	void* ptr = xmalloc(bytes);
+	depth--;
+	if (ptr == 0) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+EXPORT void
+free(void* ptr)
+{
+	if (ptr == 0 || is_bootstrap(ptr)) {
+		return;
+	}
+	xfree(ptr);
+}
+
+// the C23 names, the size saves a look at the page map
+EXPORT void
+free_sized(void* ptr, size_t bytes)
+{
+	if (ptr == 0 || is_bootstrap(ptr)) {
+		return;
+	}
+	xfree_sized(ptr, bytes);
+}
+
+EXPORT void
+free_aligned_sized(void* ptr, size_t align, size_t bytes)
+{
+	free(ptr);
+}
+
+EXPORT void*
+calloc(size_t count, size_t size)
+{
+	size_t bytes;
+	if (__builtin_mul_overflow(count, size, &bytes)) {
+		errno = ENOMEM;
+		return 0;
+	}
+	if (depth > 0) {
+		// the buffer is never handed out twice, so it is still zero
+		return bootstrap_alloc(bytes);
+	}
+	depth++;
+	void* ptr = xcalloc(count, size);
+	depth--;
+	if (ptr == 0) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+EXPORT void*
+realloc(void* prev, size_t bytes)
+{
+	if (prev == 0) {
+		return malloc(bytes);
+	}
+	if (bytes == 0) {
+		free(prev);
+		return 0;
+	}
+	if (is_bootstrap(prev)) {
+		// the block does not know its size, but it cannot run past the end
+		void* ptr = malloc(bytes);
+		if (ptr == 0) {
+			return 0;
+		}
+		size_t most = bootstrap + BOOTSTRAP_SIZE - (char*) prev;
+		memcpy(ptr, prev, bytes < most ? bytes : most);
+		return ptr;
+	}
+	depth++;
+	void* ptr = xrealloc(prev, bytes);
+	depth--;
+	if (ptr == 0) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+EXPORT void*
+reallocarray(void* prev, size_t count, size_t size)
+{
+	size_t bytes;
+	if (__builtin_mul_overflow(count, size, &bytes)) {
+		errno = ENOMEM;
+		return 0;
+	}
+	return realloc(prev, bytes);
+}
+
+EXPORT void*
+memalign(size_t align, size_t bytes)
+{
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	if (depth > 0) {
+		// the buffer only promises 16 bytes
+		return align <= 16 ? bootstrap_alloc(bytes) : 0;
+	}
+	depth++;
+	void* ptr = xmalloc_aligned(bytes, align);
+	depth--;
+	if (ptr == 0) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+EXPORT int
+posix_memalign(void** out, size_t align, size_t bytes)
+{
+	if (align < sizeof(void*) || (align & (align - 1)) != 0) {
+		return EINVAL;
+	}
+	void* ptr = memalign(align, bytes);
+	if (ptr == 0) {
+		return ENOMEM;
+	}
+	*out = ptr;
+	return 0;
+}
+
+EXPORT void*
+aligned_alloc(size_t align, size_t bytes)
+{
+	return memalign(align, bytes);
+}
+
+EXPORT void*
+valloc(size_t bytes)
+{
+	return memalign(4096, bytes);
+}
+
+EXPORT void*
+pvalloc(size_t bytes)
+{
+	if (bytes > SIZE_MAX - 4095) {
+		errno = ENOMEM;
+		return 0;
+	}
+	return memalign(4096, (bytes + 4095) & -4096);
+}
+
+EXPORT size_t
+malloc_usable_size(void* ptr)
+{
+	if (ptr == 0 || is_bootstrap(ptr)) {
+		return 0;
+	}
+	return xmalloc_usable_size(ptr);
+}
@@ -0,0 +1,117 @@
+#include <cstddef>
+#include <new>
+
+// The C++ operators of libopt_malloc.so, on top of the C functions in
+// opt_preload.c. When those come back empty handed the throwing operators
+// run the new_handler and try again, and throw std::bad_alloc once there
+// is none, the nothrow ones return null instead.
+
+#define EXPORT __attribute__((visibility("default")))
+
+extern "C" {
+void* malloc(std::size_t bytes);
+void free(void* ptr);
+void free_sized(void* ptr, std::size_t bytes);
+void* memalign(std::size_t align, std::size_t bytes);
+}
+
+static void*
+new_bytes(std::size_t bytes)
+{
+	for (;;) {
+		void* ptr = malloc(bytes);
+		if (ptr) {
+			return ptr;
+		}
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+static void*
+new_aligned(std::size_t bytes, std::align_val_t align)
+{
+	for (;;) {
+		void* ptr = memalign(static_cast<std::size_t>(align), bytes);
+		if (ptr) {
+			return ptr;
+		}
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+EXPORT void* operator new(std::size_t bytes) { return new_bytes(bytes); }
+EXPORT void* operator new[](std::size_t bytes) { return new_bytes(bytes); }
+
+EXPORT void*
+operator new(std::size_t bytes, const std::nothrow_t&) noexcept
+{
+	try {
+		return new_bytes(bytes);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+EXPORT void*
+operator new[](std::size_t bytes, const std::nothrow_t&) noexcept
+{
+	try {
+		return new_bytes(bytes);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+EXPORT void operator delete(void* ptr) noexcept { free(ptr); }
+EXPORT void operator delete[](void* ptr) noexcept { free(ptr); }
+EXPORT void operator delete(void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+EXPORT void operator delete[](void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+EXPORT void operator delete(void* ptr, std::size_t bytes) noexcept { free_sized(ptr, bytes); }
+EXPORT void operator delete[](void* ptr, std::size_t bytes) noexcept { free_sized(ptr, bytes); }
+
+EXPORT void*
+operator new(std::size_t bytes, std::align_val_t align)
+{
+	return new_aligned(bytes, align);
+}
+
+EXPORT void*
+operator new[](std::size_t bytes, std::align_val_t align)
+{
+	return new_aligned(bytes, align);
+}
+
+EXPORT void*
+operator new(std::size_t bytes, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	try {
+		return new_aligned(bytes, align);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+EXPORT void*
+operator new[](std::size_t bytes, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	try {
+		return new_aligned(bytes, align);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+EXPORT void operator delete(void* ptr, std::align_val_t) noexcept { free(ptr); }
+EXPORT void operator delete[](void* ptr, std::align_val_t) noexcept { free(ptr); }
+EXPORT void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { free(ptr); }
+EXPORT void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { free(ptr); }
+EXPORT void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { free(ptr); }
+EXPORT void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { free(ptr); }
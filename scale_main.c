@@ -0,0 +1,197 @@
+// The Collatz search of list_main.c and ivec_main.c, for scaling runs on
+// many cores: the thread count is an argument, and the driver keeps its
+// own synchronization out of the way of the allocator's.
+//
+// Threads claim CHUNK tasks at a time by bumping one shared cursor, which
+// wraps around the tasks pass after pass. A slow thread can still be a
+// lap behind, so each task is taken with a compare-and-swap on its dibs
+// flag rather than a lock, and skipped when someone else has it. Tasks
+// that are done are skipped without touching dibs at all.
+//
+// usage: collatz-scale-opt list|ivec TOP [THREADS]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "xmalloc.h"
+#include "list.h"
+#include "ivec.h"
+
+#define CHUNK 64
+#define MAX_THREADS 1024
+
+typedef struct num_task {
+    void* vals; // a cell* or an ivec*
+    long  steps;
+    int   dibs;
+} num_task;
+
+num_task** tasks;
+long data_top = 0;
+int use_ivec = 0;
+// counts up forever, task 1 + cursor % (data_top - 1) is next
+long cursor = 0;
+// tasks whose steps are not known yet
+long remaining = 0;
+
+double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long
+collatz_step(long n)
+{
+    if (n % 2 == 0) {
+        return n/2;
+    }
+    else {
+        return 3*n + 1;
+    }
+}
+
+// moves the task up to 50 steps along, the way list_main.c does, and
+// returns the step count once its sequence has reached 1, or -1
+long
+advance_list(num_task* task)
+{
+    cell* xs = task->vals;
+    if (xs->item > 1) {
+        xs = copy_list(xs);
+        long vv = 0;
+        for (int jj = 0; vv != 1 && jj < 50; ++jj) {
+            vv = collatz_step(xs->item);
+            xs = cons(vv, xs);
+        }
+        free_list(task->vals);
+        task->vals = xs;
+    }
+    return xs->item == 1 ? count_list(xs) - 1 : -1;
+}
+
+// the same as advance_list, the way ivec_main.c does it
+long
+advance_ivec(num_task* task)
+{
+    ivec* xs = task->vals;
+    if (ivec_last(xs) > 1) {
+        xs = ivec_copy(xs);
+        long vv = 0;
+        for (int jj = 0; vv != 1 && jj < 50; ++jj) {
+            vv = collatz_step(ivec_last(xs));
+            ivec_push(xs, vv);
+        }
+        free_ivec(task->vals);
+        task->vals = xs;
+    }
+    return ivec_last(xs) == 1 ? xs->size - 1 : -1;
+}
+
+void*
+worker(void* _arg)
+{
+    while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE) > 0) {
+        long start = __atomic_fetch_add(&cursor, CHUNK, __ATOMIC_RELAXED);
+        for (long kk = start; kk < start + CHUNK; ++kk) {
+            num_task* task = tasks[1 + kk % (data_top - 1)];
+            if (__atomic_load_n(&(task->steps), __ATOMIC_ACQUIRE) != -1) {
+                continue;
+            }
+            int free_dibs = 0;
+            if (!__atomic_compare_exchange_n(&(task->dibs), &free_dibs, 1, 0,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            // it may have finished between the check and the swap
+            if (task->steps == -1) {
+                long steps = use_ivec ? advance_ivec(task) : advance_list(task);
+                if (steps != -1) {
+                    __atomic_store_n(&(task->steps), steps, __ATOMIC_RELEASE);
+                    __atomic_fetch_sub(&remaining, 1, __ATOMIC_RELEASE);
+                }
+            }
+            __atomic_store_n(&(task->dibs), 0, __ATOMIC_RELEASE);
+        }
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 3 || argc > 4 ||
+        (strcmp(argv[1], "list") != 0 && strcmp(argv[1], "ivec") != 0)) {
+        printf("Usage:\n");
+        printf("\t%s list|ivec TOP [THREADS]\n", argv[0]);
+        return 1;
+    }
+
+    use_ivec = strcmp(argv[1], "ivec") == 0;
+    data_top = atol(argv[2]);
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+    if (data_top < 2 || threads < 1 || threads > MAX_THREADS) {
+        printf("TOP must be at least 2 and THREADS from 1 to %d\n", MAX_THREADS);
+        return 1;
+    }
+
+    tasks = xmalloc(data_top * sizeof(num_task*));
+    for (long ii = 0; ii < data_top; ++ii) {
+        tasks[ii] = xmalloc(sizeof(num_task));
+        if (use_ivec) {
+            ivec* xs = make_ivec(4);
+            ivec_push(xs, ii);
+            tasks[ii]->vals = xs;
+        }
+        else {
+            tasks[ii]->vals = cons(ii, 0);
+        }
+        tasks[ii]->steps = -1;
+        tasks[ii]->dibs  = 0;
+    }
+    remaining = data_top - 1;
+
+    double t0 = now_sec();
+    pthread_t* ids = xmalloc(threads * sizeof(pthread_t));
+    for (int ii = 0; ii < threads; ++ii) {
+        int rv = pthread_create(&(ids[ii]), 0, worker, 0);
+        assert(rv == 0);
+    }
+    for (int ii = 0; ii < threads; ++ii) {
+        int rv = pthread_join(ids[ii], 0);
+        assert(rv == 0);
+    }
+    double t1 = now_sec();
+    xfree(ids);
+
+    long max_v = 0;
+    long max_s = 0;
+
+    for (long ii = 1; ii < data_top; ++ii) {
+        if (tasks[ii]->steps > max_s) {
+            max_v = ii;
+            max_s = tasks[ii]->steps;
+        }
+    }
+
+    printf("Max steps is at %ld: %ld steps\n", max_v, max_s);
+    printf("%d threads: %.3f s\n", threads, t1 - t0);
+
+    for (long ii = 0; ii < data_top; ++ii) {
+        if (use_ivec) {
+            free_ivec(tasks[ii]->vals);
+        }
+        else {
+            free_list(tasks[ii]->vals);
+        }
+        xfree(tasks[ii]);
+    }
+    xfree(tasks);
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef SIZE_CLASSES_H
+#define SIZE_CLASSES_H
+
+// The size classes of opt_malloc, smallest first, written as
+// X(block size in bytes, pages per slab, extra argument).
+//
+// This list is the whole configuration: the number of bins, the biggest
+// small size and the size to class lookup table are all derived from it
+// when the allocator is compiled. Each class gets a slab just big enough
+// that the page header and the unusable tail waste at most ~3% of it.
+//
+// Every size is a multiple of 16, and blocks start a multiple of 64 bytes
+// into their slab, so every block is 16 byte aligned and every block of a
+// class that is a multiple of 64 starts on a cache line. Past 64 there are
+// four classes per doubling, so no block is more than 25% too big.
+#define SIZE_CLASSES(X, a) \
+	X(16, 2, a) \
+	X(32, 2, a) \
+	X(48, 2, a) \
+	X(64, 2, a) \
+	X(80, 2, a) \
+	X(96, 2, a) \
+	X(112, 2, a) \
+	X(128, 2, a) \
+	X(160, 2, a) \
+	X(192, 2, a) \
+	X(224, 2, a) \
+	X(256, 3, a) \
+	X(320, 2, a) \
+	X(384, 2, a) \
+	X(448, 2, a) \
+	X(512, 5, a) \
+	X(640, 3, a) \
+	X(768, 4, a) \
+	X(896, 2, a) \
+	X(1024, 9, a) \
+	X(1280, 6, a) \
+	X(1536, 5, a) \
+	X(1792, 4, a) \
+	X(2048, 16, a) \
+	X(2560, 7, a) \
+	X(3072, 10, a) \
+	X(3584, 8, a)
+
+#define SIZE_CLASS_ONE(size, pages, a) + 1
+#define NUM_CLASSES (0 SIZE_CLASSES(SIZE_CLASS_ONE, 0))
+
+// the classes are in increasing order, so this keeps only the last size
+#define SIZE_CLASS_LAST(size, pages, a) * 0 + (size)
+#define BIGGEST_SIZE (0 SIZE_CLASSES(SIZE_CLASS_LAST, 0))
+
+// The lookup table has one entry per LOOKUP_GRAIN bytes of request size,
+// entry ii being the number of classes smaller than ii * LOOKUP_GRAIN bytes,
+// which is exactly the index of the smallest class that fits. Every size
+// must be a multiple of the grain for that to hold.
+#define LOOKUP_GRAIN 16
+#define LOOKUP_SLOTS 256
+#define SIZE_CLASS_BELOW(size, pages, bytes) + ((size) < (bytes))
+#define LOOKUP_ENTRY(slot) (0 SIZE_CLASSES(SIZE_CLASS_BELOW, (slot) * LOOKUP_GRAIN)),
+
+#define REPEAT_4(f, b) f(b) f(b + 1) f(b + 2) f(b + 3)
+#define REPEAT_16(f, b) REPEAT_4(f, b) REPEAT_4(f, b + 4) REPEAT_4(f, b + 8) REPEAT_4(f, b + 12)
+#define REPEAT_64(f, b) REPEAT_16(f, b) REPEAT_16(f, b + 16) REPEAT_16(f, b + 32) REPEAT_16(f, b + 48)
+#define REPEAT_256(f, b) REPEAT_64(f, b) REPEAT_64(f, b + 64) REPEAT_64(f, b + 128) REPEAT_64(f, b + 192)
+
+#define SIZE_CLASS_CHECK(size, pages, a) \
+	_Static_assert((size) % LOOKUP_GRAIN == 0, "class not a multiple of the grain"); \
+	_Static_assert((size) % 16 == 0, "class would not keep blocks 16 byte aligned");
+
+SIZE_CLASSES(SIZE_CLASS_CHECK, 0)
+_Static_assert(BIGGEST_SIZE / LOOKUP_GRAIN < LOOKUP_SLOTS, "lookup table too small");
+
+#endif
@@ -1,22 +1,228 @@
 
 #include <stdlib.h>
+#include <malloc.h>
+#include <pthread.h>
 
 #include "xmalloc.h"
 
+// glibc serves blocks this big straight from mmap by default
+#define LARGE_SIZE (128 * 1024)
+
+// every thread counts into its own block and xmalloc_get_stats sums them.
+// A block is only written by its thread, so plain relaxed stores do and no
+// two threads fight over a cache line. The blocks stay on the list for
+// good, when a thread exits its block is up for the next new thread to
+// take over, counts and all, so there are never more of them than threads
+// that ran at the same time
+typedef struct thread_counts thread_counts;
+
+struct thread_counts {
+    size_t allocs;
+    size_t frees;
+    size_t live_bytes; // wraps around when a thread frees others' blocks
+    size_t large_allocs;
+    int in_use;
+    thread_counts* next;
+} __attribute__((aligned(64)));
+
+static thread_counts* all_counts = 0;
+static __thread thread_counts* my_counts = 0;
+// its destructor hands the block of an exiting thread back
+static pthread_key_t counts_key;
+static pthread_once_t counts_once = PTHREAD_ONCE_INIT;
+
+static void
+release_counts(void* counts)
+{
+    my_counts = 0;
+    __atomic_store_n(&(((thread_counts*) counts)->in_use), 0, __ATOMIC_RELEASE);
+}
+
+static void
+make_counts_key()
+{
+    pthread_key_create(&counts_key, release_counts);
+}
+
+// the block of the calling thread, or 0 when there is no memory for one,
+// then the call goes uncounted
+static thread_counts*
+get_counts()
+{
+    if (my_counts == 0) {
+        pthread_once(&counts_once, make_counts_key);
+        thread_counts* counts = __atomic_load_n(&all_counts, __ATOMIC_ACQUIRE);
+        for (; counts; counts = counts->next) {
+            int idle = 0;
+            if (__atomic_compare_exchange_n(&(counts->in_use), &idle, 1,
+                0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        if (counts == 0) {
+            counts = calloc(1, sizeof(thread_counts));
+            if (counts == 0) {
+                return 0;
+            }
+            counts->in_use = 1;
+            counts->next = __atomic_load_n(&all_counts, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&all_counts, &(counts->next), counts,
+                1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            }
+        }
+        pthread_setspecific(counts_key, counts);
+        my_counts = counts;
+    }
+    return my_counts;
+}
+
+static void
+bump(size_t* counter, size_t amount)
+{
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+static void
+count_alloc(void* ptr, size_t bytes)
+{
+    thread_counts* counts = get_counts();
+    if (counts == 0) {
+        return;
+    }
+    bump(&(counts->allocs), 1);
+    bump(&(counts->live_bytes), malloc_usable_size(ptr));
+    if (bytes >= LARGE_SIZE) {
+        bump(&(counts->large_allocs), 1);
+    }
+}
+
+static void
+count_free(size_t usable)
+{
+    thread_counts* counts = get_counts();
+    if (counts == 0) {
+        return;
+    }
+    bump(&(counts->frees), 1);
+    bump(&(counts->live_bytes), -usable);
+}
+
 void*
 xmalloc(size_t bytes)
 {
-    return malloc(bytes);
+    void* ptr = malloc(bytes);
+    if (ptr) {
+        count_alloc(ptr, bytes);
+    }
+    return ptr;
 }
 
 void
 xfree(void* ptr)
 {
+    if (ptr) {
+        count_free(malloc_usable_size(ptr));
+    }
     free(ptr);
 }
 
 void*
 xrealloc(void* prev, size_t bytes)
 {
-    return realloc(prev, bytes);
+    size_t usable = prev ? malloc_usable_size(prev) : 0;
+    void* ptr = realloc(prev, bytes);
+    // a failed realloc leaves the old block alone
+    if (prev && (ptr || bytes == 0)) {
+        count_free(usable);
+    }
+    if (ptr) {
+        count_alloc(ptr, bytes);
+    }
+    return ptr;
+}
+
+void*
+xcalloc(size_t count, size_t size)
+{
+    // calloc checks count * size for overflow itself
+    void* ptr = calloc(count, size);
+    if (ptr) {
+        count_alloc(ptr, count * size);
+    }
+    return ptr;
+}
+
+void*
+xmalloc_aligned(size_t bytes, size_t align)
+{
+    void* ptr = 0;
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+    if (posix_memalign(&ptr, align, bytes) != 0) {
+        return 0;
+    }
+    count_alloc(ptr, bytes);
+    return ptr;
+}
+
+// glibc has no batch calls, these only save the caller the loop
+size_t
+xmalloc_batch(size_t bytes, size_t count, void** out)
+{
+    for (size_t ii = 0; ii < count; ii++) {
+        out[ii] = xmalloc(bytes);
+        if (out[ii] == 0) {
+            return ii;
+        }
+    }
+    return count;
+}
+
+void
+xfree_batch(void** ptrs, size_t count)
+{
+    for (size_t ii = 0; ii < count; ii++) {
+        xfree(ptrs[ii]);
+    }
+}
+
+void
+xfree_sized(void* ptr, size_t bytes)
+{
+    xfree(ptr);
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+    return malloc_usable_size(ptr);
+}
+
+size_t
+xmalloc_trim()
+{
+    // malloc_trim only says whether it released anything. What it took
+    // off the top of the heap shows in arena, what it gave back from the
+    // middle with madvise doesn't show anywhere, and another thread may
+    // have grown the heap meanwhile, so this is a lower bound at best
+    struct mallinfo2 before = mallinfo2();
+    malloc_trim(0);
+    struct mallinfo2 after = mallinfo2();
+    return after.arena < before.arena ? before.arena - after.arena : 0;
+}
+
+void
+xmalloc_get_stats(xmalloc_stats* stats)
+{
+    // glibc keeps its own mmap and lock counts to itself, so only the
+    // totals are known here
+    *stats = (xmalloc_stats) { .allocator = "sys" };
+    thread_counts* counts = __atomic_load_n(&all_counts, __ATOMIC_ACQUIRE);
+    for (; counts; counts = counts->next) {
+        stats->allocs += __atomic_load_n(&(counts->allocs), __ATOMIC_RELAXED);
+        stats->frees += __atomic_load_n(&(counts->frees), __ATOMIC_RELAXED);
+        stats->live_bytes += __atomic_load_n(&(counts->live_bytes), __ATOMIC_RELAXED);
+        stats->large_allocs += __atomic_load_n(&(counts->large_allocs), __ATOMIC_RELAXED);
+    }
 }
@@ -4,7 +4,7 @@ use warnings FATAL => 'all';
 use POSIX ":sys_wait_h";
 
 use Time::HiRes qw(time);
-use Test::Simple tests => 14;
+use Test::Simple tests => 22;
 
 sub crc_check {
     my ($file, $expect) = @_;
@@ -47,6 +47,24 @@ ok($hw7_l =~ /at 97: 118 steps/, "list-hwx 100");
 my $hw7_v = run_prog("collatz-ivec-hwx", 100);
 ok($hw7_v =~ /at 97: 118 steps/, "ivec-hwx 100");
 
+$hw7_l = run_prog("collatz-list-hwx", 10000);
+ok($hw7_l =~ /at 6171: 261 steps/, "list-hwx 10k");
+
+$hw7_v = run_prog("collatz-ivec-hwx", 10000);
+ok($hw7_v =~ /at 6171: 261 steps/, "ivec-hwx 10k");
+
+$hw7_l = run_prog("collatz-list-hwx", 100000);
+ok($hw7_l =~ /at 77031: 350 steps/, "list-hwx 100k");
+
+$hw7_v = run_prog("collatz-ivec-hwx", 100000);
+ok($hw7_v =~ /at 77031: 350 steps/, "ivec-hwx 100k");
+
+my $xv6_l = run_prog("collatz-list-xv6", 1000);
+ok($xv6_l =~ /at 871: 178 steps/, "list-xv6 1k");
+
+my $xv6_v = run_prog("collatz-ivec-xv6", 1000);
+ok($xv6_v =~ /at 871: 178 steps/, "ivec-xv6 1k");
+
 my $par_v = run_prog("collatz-ivec-opt", 1000);
 my $pv_ok = $par_v =~ /at 871: 178 steps/;
 ok($pv_ok, "ivec-par 1k");
@@ -71,6 +89,12 @@ $par_l = run_prog("collatz-list-opt", 500000);
 $pl_ok = $par_l =~ /at 410011: 448 steps/;
 ok($pl_ok, "list-opt 500k");
 
+my $scale_l = run_prog("collatz-scale-opt", "list 10000 8");
+ok($scale_l =~ /at 6171: 261 steps/, "scale-list-opt 10k 8 threads");
+
+my $scale_v = run_prog("collatz-scale-opt", "ivec 10000 8");
+ok($scale_v =~ /at 6171: 261 steps/, "scale-ivec-opt 10k 8 threads");
+
 my $fragt = run_prog("frag-opt", 1);
 my $ft_ok = $fragt =~ /frag test ok/;
 ok($ft_ok, "fragmentation test");
@@ -14,8 +14,67 @@ typedef struct block_header {
 	size_t size;
 } block_header;
 
+// all of these return 0 when the request is too big or the OS is out of
+// memory
 void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
 void* xrealloc(void* prev, size_t bytes);
+// count blocks of size bytes each, all zero, or 0 if count * size does
+// not fit in a size_t
+void* xcalloc(size_t count, size_t size);
+// a block starting on a multiple of align, which is a power of two
+void* xmalloc_aligned(size_t bytes, size_t align);
+// count blocks of bytes each into out, returns how many it got
+size_t xmalloc_batch(size_t bytes, size_t count, void** out);
+// frees count blocks, null ones are skipped
+void xfree_batch(void** ptrs, size_t count);
+// frees a block of bytes, the size xmalloc or xrealloc was last given
+void xfree_sized(void* ptr, size_t bytes);
+// how many bytes the block at ptr can really hold, 0 if it is not ours
+size_t xmalloc_usable_size(void* ptr);
+// gives every cached but unused page back to the OS, returns how many bytes
+size_t xmalloc_trim();
+
+// Statistics every allocator keeps about itself. Allocators without size
+// classes or arenas report none of those and only fill in the totals.
+#define XMALLOC_MAX_CLASSES 64
+#define XMALLOC_MAX_ARENAS 256
+
+typedef struct xmalloc_class_stats {
+	size_t size; // block size of the class
+	size_t allocs;
+	size_t frees;
+	size_t live_bytes;
+	size_t pages; // pages held by slabs of the class
+} xmalloc_class_stats;
+
+typedef struct xmalloc_arena_stats {
+	size_t mmaps; // mmap and mremap calls
+	size_t munmaps;
+	size_t large_allocs; // blocks too big for any size class
+	size_t lock_acquisitions;
+} xmalloc_arena_stats;
+
+typedef struct xmalloc_stats {
+	const char* allocator;
+	size_t allocs;
+	size_t frees;
+	size_t live_bytes;
+	size_t large_allocs;
+	size_t mmaps;
+	size_t munmaps;
+	size_t lock_acquisitions;
+	int classes;
+	xmalloc_class_stats by_class[XMALLOC_MAX_CLASSES];
+	int arenas;
+	xmalloc_arena_stats by_arena[XMALLOC_MAX_ARENAS];
+} xmalloc_stats;
+
+// fills in a snapshot of the counters, summed over threads and arenas
+void xmalloc_get_stats(xmalloc_stats* stats);
+// writes the snapshot to fd, as text or as one JSON object; set the
+// XMALLOC_STATS environment variable to "text" or "json" to get it on
+// stderr when the program exits
+void xmalloc_print_stats(int fd, int json);
 
 #endif
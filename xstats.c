@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "xstats.h"
+
+// Printing of xmalloc_stats, shared by every allocator, and the out_buf
+// writer behind it that opt_malloc's heap profiles go through as well.
+
+void
+out_flush(out_buf* out)
+{
+	size_t done = 0;
+	while (done < out->used) {
+		ssize_t rv = write(out->fd, out->data + done, out->used - done);
+		if (rv <= 0) {
+			break;
+		}
+		done += rv;
+	}
+	out->used = 0;
+}
+
+void
+out_put(out_buf* out, const char* fmt, ...)
+{
+	char line[512];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len < 0) {
+		return;
+	}
+	if (len >= sizeof(line)) {
+		len = sizeof(line) - 1;
+	}
+	if (out->used + len > sizeof(out->data)) {
+		out_flush(out);
+	}
+	memcpy(out->data + out->used, line, len);
+	out->used += len;
+}
+
+static void
+print_text(out_buf* out, xmalloc_stats* st)
+{
+	out_put(out, "xmalloc stats (%s)\n", st->allocator);
+	out_put(out, "  allocs %zu frees %zu live bytes %zu large allocs %zu\n",
+		st->allocs, st->frees, st->live_bytes, st->large_allocs);
+	out_put(out, "  mmaps %zu munmaps %zu lock acquisitions %zu\n",
+		st->mmaps, st->munmaps, st->lock_acquisitions);
+	if (st->classes > 0) {
+		out_put(out, "  %8s %12s %12s %12s %8s\n", "size", "allocs", "frees",
+			"live bytes", "pages");
+	}
+	for (int ii = 0; ii < st->classes; ii++) {
+		xmalloc_class_stats* cs = &(st->by_class[ii]);
+		out_put(out, "  %8zu %12zu %12zu %12zu %8zu\n", cs->size, cs->allocs,
+			cs->frees, cs->live_bytes, cs->pages);
+	}
+	if (st->arenas > 0) {
+		out_put(out, "  %8s %12s %12s %12s %12s\n", "arena", "mmaps", "munmaps",
+			"large", "locks");
+	}
+	for (int ii = 0; ii < st->arenas; ii++) {
+		xmalloc_arena_stats* as = &(st->by_arena[ii]);
+		out_put(out, "  %8d %12zu %12zu %12zu %12zu\n", ii, as->mmaps,
+			as->munmaps, as->large_allocs, as->lock_acquisitions);
+	}
+}
+
+static void
+print_json(out_buf* out, xmalloc_stats* st)
+{
+	out_put(out, "{\"allocator\": \"%s\", \"allocs\": %zu, \"frees\": %zu, "
+		"\"live_bytes\": %zu, \"large_allocs\": %zu, \"mmaps\": %zu, "
+		"\"munmaps\": %zu, \"lock_acquisitions\": %zu, \"classes\": [",
+		st->allocator, st->allocs, st->frees, st->live_bytes,
+		st->large_allocs, st->mmaps, st->munmaps, st->lock_acquisitions);
+	for (int ii = 0; ii < st->classes; ii++) {
+		xmalloc_class_stats* cs = &(st->by_class[ii]);
+		out_put(out, "%s{\"size\": %zu, \"allocs\": %zu, \"frees\": %zu, "
+			"\"live_bytes\": %zu, \"pages\": %zu}", ii ? ", " : "",
+			cs->size, cs->allocs, cs->frees, cs->live_bytes, cs->pages);
+	}
+	out_put(out, "], \"arenas\": [");
+	for (int ii = 0; ii < st->arenas; ii++) {
+		xmalloc_arena_stats* as = &(st->by_arena[ii]);
+		out_put(out, "%s{\"mmaps\": %zu, \"munmaps\": %zu, \"large_allocs\": %zu, "
+			"\"lock_acquisitions\": %zu}", ii ? ", " : "", as->mmaps,
+			as->munmaps, as->large_allocs, as->lock_acquisitions);
+	}
+	out_put(out, "]}\n");
+}
+
+void
+xmalloc_print_stats(int fd, int json)
+{
+	// both are too big to be comfortable on a small thread stack
+	static xmalloc_stats st;
+	static out_buf out;
+	xmalloc_get_stats(&st);
+	out.fd = fd;
+	out.used = 0;
+	if (json) {
+		print_json(&out, &st);
+	} else {
+		print_text(&out, &st);
+	}
+	out_flush(&out);
+}
+
+static int dump_json = 0;
+
+static void
+dump_at_exit()
+{
+	xmalloc_print_stats(2, dump_json);
+}
+
+// XMALLOC_STATS=text or XMALLOC_STATS=json dumps the stats on stderr when
+// the program exits
+__attribute__((constructor))
+static void
+setup_dump()
+{
+	char* env = getenv("XMALLOC_STATS");
+	if (env == 0 || *env == 0) {
+		return;
+	}
+	dump_json = strcmp(env, "json") == 0;
+	atexit(dump_at_exit);
+}
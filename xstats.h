@@ -0,0 +1,22 @@
+#ifndef XSTATS_H
+#define XSTATS_H
+
+#include <stddef.h>
+
+// A buffered writer on a file descriptor for reports an allocator makes
+// about itself. Lines are formatted into a buffer and go out with
+// write(2), so writing a report never calls the allocator it is about.
+typedef struct out_buf {
+	int fd;
+	size_t used;
+	char data[4096];
+} out_buf;
+
+// writes out what is in the buffer and empties it
+void out_flush(out_buf* out);
+// appends one printf formatted piece of at most 511 bytes, flushing first
+// if it doesn't fit
+void out_put(out_buf* out, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#endif
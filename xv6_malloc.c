@@ -2,6 +2,10 @@
 #include <sys/mman.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
 
 #include "xmalloc.h"
 
@@ -27,43 +31,152 @@ union header {
 
 typedef union header Header;
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static Header base;
-static Header *freep;
+// the most a block can hold, its size in units has to fit in s.size
+#define MAXBYTES ((size_t)(UINT_MAX - 1) * sizeof(Header))
 
-static
-void
-xfree_helper(void *ap)
+// Each arena is a whole K&R allocator of its own: a lock, a free list with
+// its rover and the regions morecore mapped for it. Threads are handed
+// arenas round robin the first time they allocate, so they mostly stay out
+// of each other's way, and a block goes back to the arena it came from
+// whichever thread frees it. One arena per online cpu, unless
+// XV6_MALLOC_ARENAS says otherwise.
+#define MAXARENA 64
+
+typedef struct arena {
+  pthread_mutex_t lock;
+  Header base;
+  Header *freep;
+  // counters for xmalloc_get_stats, all of them only change under lock
+  xmalloc_stats counts;
+} __attribute__((aligned(64))) Arena;
+
+static Arena arenas[MAXARENA];
+static int narena;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+static __thread int thread_arena = -1;
+static int next_arena;
+
+// The arena map has one byte for every page of the address space, 1 + the
+// index of the arena whose region the page is in, so xfree finds the owner
+// of a block from its address alone. Like opt_malloc's page map it is a two
+// level radix tree, the top level indexed by address bits 47..32 and each
+// leaf by bits 31..12, with leaves mapped the first time they are needed.
+#define MAPTOP (1 << 16)
+#define MAPLEAF (1 << 20)
+
+static uint8_t *arena_map[MAPTOP];
+
+static void
+init_arenas(void)
+{
+  char *env;
+  int i;
+
+  narena = sysconf(_SC_NPROCESSORS_ONLN);
+  if((env = getenv("XV6_MALLOC_ARENAS")) != 0)
+    narena = atoi(env);
+  if(narena < 1)
+    narena = 1;
+  if(narena > MAXARENA)
+    narena = MAXARENA;
+  for(i = 0; i < narena; i++)
+    pthread_mutex_init(&arenas[i].lock, 0);
+}
+
+static Arena*
+my_arena(void)
+{
+  if(thread_arena < 0){
+    pthread_once(&arenas_once, init_arenas);
+    thread_arena = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % narena;
+  }
+  return &arenas[thread_arena];
+}
+
+// the arena a block handed out by xmalloc belongs to
+static Arena*
+owner(void *ap)
+{
+  uintptr_t page = (uintptr_t)ap / 4096;
+  uint8_t *leaf;
+
+  leaf = __atomic_load_n(&arena_map[page / MAPLEAF], __ATOMIC_ACQUIRE);
+  return &arenas[leaf[page % MAPLEAF] - 1];
+}
+
+// records that the pages from p up to p + n belong to a, returns -1 when
+// there is no memory for the map
+static int
+map_region(Arena *a, void *p, size_t n)
+{
+  uintptr_t page, last;
+  uint8_t *leaf, *fresh;
+
+  last = ((uintptr_t)p + n - 1) / 4096;
+  for(page = (uintptr_t)p / 4096; page <= last; page++){
+    leaf = __atomic_load_n(&arena_map[page / MAPLEAF], __ATOMIC_ACQUIRE);
+    if(leaf == 0){
+      fresh = mmap(0, MAPLEAF, PROT_READ|PROT_WRITE,
+                   MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+      if(fresh == MAP_FAILED)
+        return -1;
+      a->counts.mmaps++;
+      // another arena may have put one in first, then use that one
+      if(__atomic_compare_exchange_n(&arena_map[page / MAPLEAF], &leaf, fresh,
+                                     0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        leaf = fresh;
+      else {
+        munmap(fresh, MAPLEAF);
+        a->counts.munmaps++;
+      }
+    }
+    leaf[page % MAPLEAF] = a - arenas + 1;
+  }
+  return 0;
+}
+
+static void
+xfree_helper(Arena *a, void *ap)
 {
   Header *bp, *p;
 
   bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
+  for(p = a->freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
-  if(bp + bp->s.size == p->s.ptr){
+  // neighbours only merge while the size still fits in s.size
+  if(bp + bp->s.size == p->s.ptr &&
+     bp->s.size + (size_t)p->s.ptr->s.size <= UINT_MAX){
     bp->s.size += p->s.ptr->s.size;
     bp->s.ptr = p->s.ptr->s.ptr;
   } else
     bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
+  if(p + p->s.size == bp && p->s.size + (size_t)bp->s.size <= UINT_MAX){
     p->s.size += bp->s.size;
     p->s.ptr = bp->s.ptr;
   } else
     p->s.ptr = bp;
-  freep = p;
+  a->freep = p;
 }
 
 void
 xfree(void* ap)
 {
-  pthread_mutex_lock(&lock);
-  xfree_helper(ap);
-  pthread_mutex_unlock(&lock);
+  Arena *a;
+
+  if(ap == 0)
+    return;
+  a = owner(ap);
+  pthread_mutex_lock(&a->lock);
+  a->counts.lock_acquisitions++;
+  a->counts.frees++;
+  a->counts.live_bytes -= (((Header*)ap - 1)->s.size - 1) * sizeof(Header);
+  xfree_helper(a, ap);
+  pthread_mutex_unlock(&a->lock);
 }
 
 static Header*
-morecore(size_t nu)
+morecore(Arena *a, size_t nu)
 {
   char *p;
   Header *hp;
@@ -75,40 +188,56 @@ morecore(size_t nu)
            MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
   if(p == (char*)-1)
     return 0;
+  a->counts.mmaps++;
+  if(map_region(a, p, nu * sizeof(Header)) < 0){
+    munmap(p, nu * sizeof(Header));
+    a->counts.munmaps++;
+    return 0;
+  }
   hp = (Header*)p;
   hp->s.size = nu;
-  xfree_helper((void*)(hp + 1));
-  return freep;
+  xfree_helper(a, (void*)(hp + 1));
+  return a->freep;
 }
 
 void*
 xmalloc(size_t nbytes)
 {
-  Header *p, *prevp;
+  Arena *a = my_arena();
+  Header *p, *prevp, *np;
   unsigned int nunits;
 
-  pthread_mutex_lock(&lock);
+  if(nbytes > MAXBYTES)
+    return 0;
+  pthread_mutex_lock(&a->lock);
+  a->counts.lock_acquisitions++;
   nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  if((prevp = a->freep) == 0){
+    a->base.s.ptr = a->freep = prevp = &a->base;
+    a->base.s.size = 0;
   }
   for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
     if(p->s.size >= nunits){
       if(p->s.size == nunits)
         prevp->s.ptr = p->s.ptr;
       else {
-        p->s.size -= nunits;
-        p += p->s.size;
+        // carve from the front, so what is left stays right behind the
+        // new block and xrealloc can grow into it
+        np = p + nunits;
+        np->s.size = p->s.size - nunits;
+        np->s.ptr = p->s.ptr;
+        prevp->s.ptr = np;
         p->s.size = nunits;
       }
-      freep = prevp;
-      pthread_mutex_unlock(&lock);
+      a->freep = prevp;
+      a->counts.allocs++;
+      a->counts.live_bytes += (nunits - 1) * sizeof(Header);
+      pthread_mutex_unlock(&a->lock);
       return (void*)(p + 1);
     }
-    if(p == freep) {
-      if((p = morecore(nunits)) == 0) {
-        pthread_mutex_unlock(&lock);
+    if(p == a->freep) {
+      if((p = morecore(a, nunits)) == 0) {
+        pthread_mutex_unlock(&a->lock);
         return 0;
       }
     }
@@ -116,8 +245,198 @@ xmalloc(size_t nbytes)
 }
 
 void*
-xrealloc(void* prev, size_t nn)
+xcalloc(size_t count, size_t size)
+{
+  size_t nbytes;
+  void *ap;
+
+  if(__builtin_mul_overflow(count, size, &nbytes))
+    return 0;
+  if((ap = xmalloc(nbytes)) != 0)
+    memset(ap, 0, nbytes);
+  return ap;
+}
+
+void*
+xmalloc_aligned(size_t nbytes, size_t align)
+{
+  Arena *a;
+  Header *bp, *np;
+  void *ap;
+  size_t front;
+
+  // blocks are a whole number of headers after a header
+  if(align <= sizeof(Header))
+    return xmalloc(nbytes);
+  if(nbytes > MAXBYTES || align > MAXBYTES - nbytes)
+    return 0;
+  if((ap = xmalloc(nbytes + align)) == 0)
+    return 0;
+  bp = (Header*)ap - 1;
+  np = (Header*)(((uintptr_t)(bp + 1) + align - 1) & -align) - 1;
+  front = np - bp;
+  if(front == 0)
+    return (void*)(np + 1);
+  // the units in front of the boundary go back on the free list
+  a = owner(ap);
+  pthread_mutex_lock(&a->lock);
+  np->s.size = bp->s.size - front;
+  bp->s.size = front;
+  a->counts.live_bytes -= front * sizeof(Header);
+  xfree_helper(a, (void*)(bp + 1));
+  pthread_mutex_unlock(&a->lock);
+  return (void*)(np + 1);
+}
+
+void*
+xrealloc(void* ap, size_t nbytes)
+{
+  Arena *a;
+  Header *bp, *np, *p, *prevp;
+  unsigned int nunits, have;
+  void *nap;
+  size_t old;
+
+  if(ap == 0)
+    return xmalloc(nbytes);
+  if(nbytes > MAXBYTES)
+    return 0;
+  bp = (Header*)ap - 1;
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  a = owner(ap);
+  pthread_mutex_lock(&a->lock);
+  a->counts.lock_acquisitions++;
+  have = bp->s.size;
+  if(nunits > have){
+    // grow into the block right behind this one if it is free, it is in
+    // the same region so on the same arena's list. The list is in address
+    // order, so it can only be the one after where bp would go, found the
+    // way xfree_helper finds it
+    np = bp + have;
+    for(prevp = a->freep; !(bp > prevp && bp < prevp->s.ptr); prevp = prevp->s.ptr)
+      if(prevp >= prevp->s.ptr && (bp > prevp || bp < prevp->s.ptr))
+        break;
+    p = prevp->s.ptr == np ? np : 0;
+    if(p && have + (size_t)p->s.size >= nunits){
+      if(have + (size_t)p->s.size == nunits)
+        prevp->s.ptr = p->s.ptr;
+      else {
+        np = bp + nunits;
+        np->s.size = have + p->s.size - nunits;
+        np->s.ptr = p->s.ptr;
+        prevp->s.ptr = np;
+      }
+      a->freep = prevp;
+      bp->s.size = nunits;
+      a->counts.live_bytes += (nunits - have) * sizeof(Header);
+      pthread_mutex_unlock(&a->lock);
+      return ap;
+    }
+  }
+  if(nunits <= have){
+    // the tail goes back on the free list
+    if(have > nunits){
+      np = bp + nunits;
+      np->s.size = have - nunits;
+      bp->s.size = nunits;
+      a->counts.live_bytes -= (have - nunits) * sizeof(Header);
+      xfree_helper(a, (void*)(np + 1));
+    }
+    pthread_mutex_unlock(&a->lock);
+    return ap;
+  }
+  pthread_mutex_unlock(&a->lock);
+  // nothing else for it but to copy
+  if((nap = xmalloc(nbytes)) == 0)
+    return 0;
+  old = (have - 1) * sizeof(Header);
+  memcpy(nap, ap, old < nbytes ? old : nbytes);
+  xfree(ap);
+  return nap;
+}
+
+size_t
+xmalloc_batch(size_t nbytes, size_t count, void** out)
+{
+  size_t i;
+
+  for(i = 0; i < count; i++)
+    if((out[i] = xmalloc(nbytes)) == 0)
+      break;
+  return i;
+}
+
+void
+xfree_batch(void** ptrs, size_t count)
 {
-  // TODO: implement a working realloc
-  return prev + nn;
+  Arena *a, *held;
+  size_t i;
+
+  // one trip through a lock for every run of blocks from the same arena
+  held = 0;
+  for(i = 0; i < count; i++){
+    if(ptrs[i] == 0)
+      continue;
+    a = owner(ptrs[i]);
+    if(a != held){
+      if(held)
+        pthread_mutex_unlock(&held->lock);
+      held = a;
+      pthread_mutex_lock(&a->lock);
+      a->counts.lock_acquisitions++;
+    }
+    a->counts.frees++;
+    a->counts.live_bytes -= (((Header*)ptrs[i] - 1)->s.size - 1) * sizeof(Header);
+    xfree_helper(a, ptrs[i]);
+  }
+  if(held)
+    pthread_mutex_unlock(&held->lock);
+}
+
+void
+xfree_sized(void* ap, size_t nbytes)
+{
+  xfree(ap);
+}
+
+size_t
+xmalloc_usable_size(void* ap)
+{
+  Header *bp = (Header*)ap - 1;
+  return (bp->s.size - 1) * sizeof(Header);
+}
+
+size_t
+xmalloc_trim()
+{
+  // morecore regions are never given back
+  return 0;
+}
+
+void
+xmalloc_get_stats(xmalloc_stats* stats)
+{
+  Arena *a;
+  xmalloc_arena_stats *as;
+  int i;
+
+  memset(stats, 0, sizeof(*stats));
+  stats->allocator = "xv6";
+  pthread_once(&arenas_once, init_arenas);
+  stats->arenas = narena;
+  for(i = 0; i < narena; i++){
+    a = &arenas[i];
+    as = &stats->by_arena[i];
+    pthread_mutex_lock(&a->lock);
+    stats->allocs += a->counts.allocs;
+    stats->frees += a->counts.frees;
+    stats->live_bytes += a->counts.live_bytes;
+    as->mmaps = a->counts.mmaps;
+    as->munmaps = a->counts.munmaps;
+    as->lock_acquisitions = a->counts.lock_acquisitions;
+    pthread_mutex_unlock(&a->lock);
+    stats->mmaps += as->mmaps;
+    stats->munmaps += as->munmaps;
+    stats->lock_acquisitions += as->lock_acquisitions;
+  }
 }